@@ -3,12 +3,33 @@
 #include <stdbool.h>
 #include "atcmd.h"
 #include "pstore.h"
+#include "config_hdlr.h"
+#include "util.h"
 //#include "SEGGER_RTT.h"
 
-#define n_array (sizeof (m_atcmds) / sizeof (const char *))
+#define ATCMD_PREFIX_LEN    3   // "at$"
+#define ATCMD_INDEX_SIZE    26  // one slot per lower case letter after the prefix
+#define ATCMD_INDEX_NONE    0xff
+
+#define ATCMD_ENTRY(cmd, act, desc, bulk) \
+	{cmd, sizeof(cmd) - 1, act, desc, sizeof(desc) / sizeof(atcmd_param_desc_t), bulk}
+#define ATCMD_ENTRY_NP(cmd, act) \
+	{cmd, sizeof(cmd) - 1, act, NULL, 0, ATCMD_NO_BULK}
+
+// Numeric parameter stored in field, with an optional copy of its digits (APP_WORD_STR_LEN).
+#define ATCMD_PARAM_NUM(field, lo, hi, text) \
+	{0, sizeof(field), lo, hi, &(field), text}
+// String parameter copied, with its \0, into the char array field.
+#define ATCMD_PARAM_STR(field) \
+	{1, sizeof(field), 0, 0, (field), NULL}
+// String parameter streamed into the char array buf while it arrives.
+#define ATCMD_PARAM_BULK(buf) \
+	{1, 0, 0, sizeof(buf), (buf), NULL}
+// String parameter streamed into the bulk buffer of the stream, so it can be queued.
+#define ATCMD_PARAM_BULK_LOCAL() \
+	{1, 0, 0, APP_ATCMD_BULK_LEN, NULL, NULL}
+#define n_array (sizeof (m_atcmds) / sizeof (atcmd_entry_t))
 
-static char m_atcmd_cur[APP_ATCMD_LENGTH];
-static char m_atcmd_param[APP_ATCMD_PARA_MAX][APP_ATCMD_PARA_LENGTH];
 static char m_space = ' ';
 static char m_cr = '\r';
 static char m_ok_str[] ="OK";
@@ -17,377 +38,623 @@ static char m_in_str[] ="IN";
 static char m_out_str[] ="OUT";
 static char m_def_building_code[] = "BUL001";
 
+// at$cfgset file. It is written a byte at a time from the UART and NUS
+// interrupts, where the staging area in flash cannot be written.
 static char m_configdata[PSTORE_MAX_BLOCK];
 static char m_last_sentence[APP_ATCMD_SENTENCE_LEN] = "NUL";
 
 static atcmd_data_t m_scanner;
 
-static const char * m_atcmds[] = {
-    "at$scan",
-    "at$mode",
-    "at$scanint",
-	"at$scan?",
-	"at$mode?",
-	"at$scanint?",
-	"at$cfgget?",
-	"at$cfgset",
-	"at$cfggetv?",
-	"at$cfgupd",
-	"at$curts?",
-	"at$lastsen?"
+// Stream currently writing its bulk parameter, which may be shared.
+static atcmd_stream_t *m_bulk_owner = NULL;
+
+// Commands waiting for the main loop. Only the interfaces move the head and
+// only the main loop moves the tail.
+static atcmd_queue_item_t m_queue[APP_ATCMD_QUEUE_LEN];
+static volatile uint8_t m_queue_head = 0;
+static volatile uint8_t m_queue_tail = 0;
+
+static const atcmd_param_desc_t m_scan[] = {   // scan status
+	ATCMD_PARAM_NUM(m_scanner.enable, 0, 9, NULL)
+};
+static const atcmd_param_desc_t m_mode[] = {   // working mode
+	ATCMD_PARAM_NUM(m_scanner.mode, 0, 9, NULL)
+};
+static const atcmd_param_desc_t m_scanint[] = {   // scan interval, scan window
+	ATCMD_PARAM_NUM(m_scanner.scan_interval, 1, 0xFFFF, m_scanner.scan_interval_str),
+	ATCMD_PARAM_NUM(m_scanner.scan_window, 1, 0xFFFF, m_scanner.scan_window_str)
+};
+static const atcmd_param_desc_t m_configdat[] = {   // version string, config data size
+	ATCMD_PARAM_STR(m_scanner.version_str),
+	ATCMD_PARAM_NUM(m_scanner.config_size, 1, PSTORE_MAX_BLOCK, m_scanner.config_size_str),
+	ATCMD_PARAM_BULK(m_configdata)   // config data, no white space support
+};
+static const atcmd_param_desc_t m_configchunk[] = {   // chunk offset, chunk data
+	ATCMD_PARAM_NUM(m_scanner.chunk_offset, 0, PSTORE_MAX_BLOCK - 1, NULL),
+	ATCMD_PARAM_BULK_LOCAL()
+};
+static const atcmd_param_desc_t m_configpatch[] = {   // <key>=<value> of one entry
+	ATCMD_PARAM_BULK_LOCAL()
+};
+static const atcmd_param_desc_t m_baud[] = {   // baud rate, RTS/CTS flow control
+	ATCMD_PARAM_NUM(m_scanner.baud_rate, 9600, 1000000, NULL),
+	ATCMD_PARAM_NUM(m_scanner.flow_control, 0, 1, NULL)
+};
+static const atcmd_param_desc_t m_configcommit[] = {   // config data size, CRC-16/CCITT
+	ATCMD_PARAM_NUM(m_scanner.config_size, 1, PSTORE_MAX_BLOCK - 1, m_scanner.config_size_str),
+	ATCMD_PARAM_NUM(m_scanner.config_crc, 0, 0xFFFF, NULL)
 };
 
-static atcmd_param_desc_t m_scan[] = {{0, 1}};  // scan status
-static atcmd_param_desc_t m_mode[] = {{0, 1}};  // working mode
-static atcmd_param_desc_t m_scanint[] = {{0, 2},   // scan interval
-										 {0, 2}};  // scan window
-static atcmd_param_desc_t m_configdat[] = {{1, 0},   // version string
-										   {0, 2},  // config data size
-										   {1, 0}};   // config data, no white space support
-										   
-static bool check_ascii_word (uint8_t *p_data, uint8_t len)
+/**@brief Function to convert a numeric parameter checking it against its descriptor.
+ *
+ * @param[in]  p_desc   parameter descriptor.
+ * @param[in]  p_text   parameter digits, already checked by the stream.
+ * @param[in]  len      number of digits.
+ * @param[out] p_value  converted value.
+ */
+static bool atcmd_param_to_number(const atcmd_param_desc_t *p_desc,
+                                  const char *p_text, uint8_t len, uint32_t *p_value)
 {
-	uint8_t i;
-	
-	if (len > 5)
+	uint8_t max_digits;
+
+	switch (p_desc->size)
+	{
+		case sizeof(uint8_t) :
+			max_digits = CONFIG_BYTE_DIGITS_MAX;
+			break;
+
+		case sizeof(uint16_t) :
+			max_digits = CONFIG_WORD_DIGITS_MAX;
+			break;
+
+		default :
+			max_digits = CONFIG_LONGWORD_DIGITS_MAX;
+			break;
+	}
+
+	if (len == 0 || len > max_digits)
 		return false;
-	
-	for (i = 0; i < len; i++)
+
+	// Ten digits may not fit in 32 bits.
+	if (len == CONFIG_LONGWORD_DIGITS_MAX && memcmp(p_text, "4294967295", len) > 0)
+		return false;
+
+	*p_value = ascii_to_longword((uint8_t *)p_text, len);
+	return (*p_value >= p_desc->min && *p_value <= p_desc->max);
+}
+
+/**@brief Function to store the stream parameters into the fields named by the descriptors.
+ * @details Every parameter is checked before the first one is written, so a
+ *          rejected command leaves the current settings untouched.
+ *
+ * @param[in] p_stream  stream holding the parameter slots.
+ */
+static bool atcmd_param_store(const atcmd_stream_t *p_stream)
+{
+	const atcmd_entry_t *p_entry = p_stream->p_entry;
+	const atcmd_param_desc_t *p_desc;
+	uint32_t value[APP_ATCMD_PARA_MAX];
+	uint8_t i;
+
+	for (i = 0; i < p_entry->n_params; i++)
 	{
-		if (*(p_data + i) < 0x30 ||
-			*(p_data + i) > 0x39)
+		p_desc = &p_entry->p_params[i];
+		if (i == p_entry->bulk)
+			continue;
+
+		if (p_desc->is_str)
+		{
+			if (p_stream->param_len[i] >= p_desc->size)
+				return false;
+		}
+		else if (!atcmd_param_to_number(p_desc, p_stream->param[i],
+		                                p_stream->param_len[i], &value[i]))
 			return false;
 	}
+
+	for (i = 0; i < p_entry->n_params; i++)
+	{
+		p_desc = &p_entry->p_params[i];
+		if (i == p_entry->bulk)
+			continue;
+
+		if (p_desc->is_str)
+		{
+			memcpy(p_desc->p_dest, p_stream->param[i], p_stream->param_len[i] + 1);
+			continue;
+		}
+
+		switch (p_desc->size)
+		{
+			case sizeof(uint8_t) :
+				*(uint8_t *)p_desc->p_dest = (uint8_t)value[i];
+				break;
+
+			case sizeof(uint16_t) :
+				*(uint16_t *)p_desc->p_dest = (uint16_t)value[i];
+				break;
+
+			default :
+				*(uint32_t *)p_desc->p_dest = value[i];
+				break;
+		}
+		if (p_desc->p_text != NULL)
+			memcpy(p_desc->p_text, p_stream->param[i], p_stream->param_len[i] + 1);
+	}
 	return true;
 }
-										 
-static uint16_t ascii_to_word (uint8_t *p_data, uint8_t len)
+
+/* Sorted by the first character after "at$", then by length, so that
+ * m_atcmd_index only has to point at the first entry of each run.
+ */
+static const atcmd_entry_t m_atcmds[] = {
+	ATCMD_ENTRY("at$baud",        APP_ATCMD_ACT_BAUD, m_baud, ATCMD_NO_BULK),
+	ATCMD_ENTRY_NP("at$bootts?",  APP_ATCMD_ACT_BOOT_TS),
+	ATCMD_ENTRY_NP("at$binmode",  APP_ATCMD_ACT_BIN_MODE),
+	ATCMD_ENTRY("at$cfgset",      APP_ATCMD_ACT_CONFIG_SET, m_configdat, 2),
+	ATCMD_ENTRY_NP("at$cfgupd",   APP_ATCMD_ACT_CONFIG_UPD),
+	ATCMD_ENTRY_NP("at$curts?",   APP_ATCMD_ACT_CURRENT_TS),
+	ATCMD_ENTRY_NP("at$cfgget?",  APP_ATCMD_ACT_CONFIG_GET),
+	ATCMD_ENTRY_NP("at$cfggetv?", APP_ATCMD_ACT_CONFIG_GET_VER),
+	ATCMD_ENTRY("at$cfgchunk",    APP_ATCMD_ACT_CONFIG_CHUNK, m_configchunk, 1),
+	ATCMD_ENTRY("at$cfgpatch",    APP_ATCMD_ACT_CONFIG_PATCH, m_configpatch, 0),
+	ATCMD_ENTRY("at$cfgcommit",   APP_ATCMD_ACT_CONFIG_COMMIT, m_configcommit, ATCMD_NO_BULK),
+	ATCMD_ENTRY_NP("at$lastsen?", APP_ATCMD_ACT_LAST_SENTENCE),
+	ATCMD_ENTRY("at$mode",        APP_ATCMD_ACT_MODE_0, m_mode, ATCMD_NO_BULK),
+	ATCMD_ENTRY_NP("at$mode?",    APP_ATCMD_ACT_MODE_0_READ),
+	ATCMD_ENTRY("at$scan",        APP_ATCMD_ACT_ENABLE_SCAN, m_scan, ATCMD_NO_BULK),
+	ATCMD_ENTRY_NP("at$scan?",    APP_ATCMD_ACT_ENABLE_SCAN_READ),
+	ATCMD_ENTRY("at$scanint",     APP_ATCMD_ACT_SCAN_INT, m_scanint, ATCMD_NO_BULK),
+	ATCMD_ENTRY_NP("at$scanint?", APP_ATCMD_ACT_SCAN_INT_READ)
+};
+
+// First m_atcmds entry for each character following the "at$" prefix.
+static uint8_t m_atcmd_index[ATCMD_INDEX_SIZE];
+// m_atcmds entry for each APP_ATCMD_ACT_xxx code, used by the binary frames.
+static uint8_t m_atcmd_action[APP_ATCMD_ACT_COUNT];
+
+/**@brief Function to build the first-character index over the sorted command table.
+ */
+static void atcmd_index_init(void)
 {
 	uint8_t i;
-	uint16_t rc = 0;
-	
-	for (i = 0; i < len; i++)
+	uint8_t slot;
+
+	memset(m_atcmd_index, ATCMD_INDEX_NONE, ATCMD_INDEX_SIZE);
+	memset(m_atcmd_action, ATCMD_INDEX_NONE, APP_ATCMD_ACT_COUNT);
+	for (i = n_array; i > 0; i--)
 	{
-		rc = (rc * 10) + *(p_data + i) - 0x30;
+		slot = m_atcmds[i - 1].p_cmd[ATCMD_PREFIX_LEN] - 'a';
+		m_atcmd_index[slot] = i - 1;
+		m_atcmd_action[m_atcmds[i - 1].action] = i - 1;
 	}
-	return (rc);
 }
 
-static uint8_t atcmd_match_cmd()
+/**@brief Function to look up a command in the sorted command table.
+ * @details Only the entries sharing the first character after the prefix are
+ *          visited, and those are skipped on length before any byte compare.
+ *
+ * @param[in] p_cmd  pointer to the command, not null terminated.
+ * @param[in] len    size, in bytes, of the command.
+ *
+ * @return the matching table entry or NULL if the command is not supported.
+ */
+static const atcmd_entry_t *atcmd_match_cmd(const char *p_cmd, uint16_t len)
 {	
-    uint8_t i;
+	uint8_t i;
+	uint8_t c;
 
-    for (i = 0; i < n_array; i++) {
-        if (!strcmp(m_atcmds[i], m_atcmd_cur))
-			break;
-    }
-	return (i);  	
+	if (len <= ATCMD_PREFIX_LEN || memcmp(p_cmd, "at$", ATCMD_PREFIX_LEN))
+		return NULL;
+
+	c = p_cmd[ATCMD_PREFIX_LEN];
+	if (c < 'a' || c > 'z' || m_atcmd_index[c - 'a'] == ATCMD_INDEX_NONE)
+		return NULL;
+
+	for (i = m_atcmd_index[c - 'a'];
+	     i < n_array && m_atcmds[i].p_cmd[ATCMD_PREFIX_LEN] == c && m_atcmds[i].len <= len;
+	     i++)
+	{
+		if (m_atcmds[i].len == len &&
+			!memcmp(m_atcmds[i].p_cmd + ATCMD_PREFIX_LEN + 1,
+			        p_cmd + ATCMD_PREFIX_LEN + 1,
+			        len - ATCMD_PREFIX_LEN - 1))
+			return (&m_atcmds[i]);
+	}
+	return NULL;
 }
 										 
-/**@brief Function to extract the command from the given raw data buffer.
- * 
- * @param[in] p_data  pointer to the first byte in the raw data buffer.
+/**@brief Function to give a stream the bulk buffer of its command.
+ * @details Buffers named by a descriptor are shared and have a single owner,
+ *          the stream local one is always free.
  */
-static bool atcmd_extract_cmd(uint16_t buffer_len, char *p_data)
+static bool atcmd_bulk_claim(atcmd_stream_t *p_stream)
 {
-	uint8_t bytedata;
-	uint8_t worddata[5] = {0};
-	uint16_t i = 0;
-	uint16_t j = 0;
-	uint16_t scan_interval;
-	uint16_t scan_window;
-	while (*(p_data + i) != m_space &&
-		*(p_data + i) != m_cr &&
-		i < buffer_len)
-		i++;
-		
-	if (i == buffer_len)
+	if (p_stream->p_entry->p_params[p_stream->p_entry->bulk].p_dest == NULL)
+		return true;
+
+	if (m_bulk_owner != NULL && m_bulk_owner != p_stream)
 		return false;
-	
-	memcpy(m_atcmd_cur, p_data, i);
-	m_atcmd_cur[i] = '\0';
-	
-	switch (atcmd_match_cmd()) {
-		case APP_ATCMD_ACT_ENABLE_SCAN :
-			// Get the next parameter, the single byte on/off status
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
-	
-			bytedata = *(p_data + i);
-			if (!m_scan[0].is_str)
-			{
-				m_scanner.enable_byte = bytedata;
-				// Convert ascii to data.
-				bytedata -= 0x30;
-				m_scanner.enable = bytedata;
-			}
+
+	m_bulk_owner = p_stream;
+	return true;
+}
+
+/**@brief Function to get the bulk buffer a stream writes into.
+ */
+static char *atcmd_bulk_buffer(atcmd_stream_t *p_stream, const atcmd_param_desc_t *p_desc)
+{
+	return ((p_desc->p_dest != NULL) ? (char *)p_desc->p_dest : p_stream->bulk);
+}
+
+/**@brief Function to close the token the stream is currently collecting.
+ * @details The command is resolved as soon as its last byte has arrived, so a
+ *          line with an unknown command is rejected before its parameters land.
+ */
+static void atcmd_stream_end_token(atcmd_stream_t *p_stream)
+{
+	switch (p_stream->state)
+	{
+		case ATCMD_STATE_CMD :
+			p_stream->p_entry = atcmd_match_cmd(p_stream->cmd, p_stream->len);
+			p_stream->state = (p_stream->p_entry != NULL) ? ATCMD_STATE_GAP : ATCMD_STATE_ERROR;
 			break;
-			
-		case APP_ATCMD_ACT_MODE_0 :
-			// Get the next parameter, the working mode value
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
-			
-			bytedata = *(p_data + i);
-			if (!m_mode[0].is_str)
-			{
-				m_scanner.mode_byte = bytedata;
-				// Convert ascii to data.
-				bytedata -= 0x30;
-				m_scanner.mode = bytedata;
-			}
+
+		case ATCMD_STATE_PARAM :
+			if (p_stream->n_params == p_stream->p_entry->bulk)
+				p_stream->bulk_len = p_stream->len;
+			else
+				p_stream->param_len[p_stream->n_params] = p_stream->len;
+			p_stream->n_params++;
+			p_stream->state = ATCMD_STATE_GAP;
 			break;
 
-		case APP_ATCMD_ACT_SCAN_INT :
-			// Get the next parameter, the 2-byte interval value
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
+		default :
+			break;
+	}
+}
 
-			j = i;
-			while (*(p_data + j) != m_space &&
-			       *(p_data + j) != m_cr)
-				j++;			
+/**@brief Function to append one byte to the parameter the stream is collecting.
+ * @details Numeric parameters are checked digit by digit, and the bulk
+ *          parameter is written straight into its destination buffer.
+ */
+static void atcmd_stream_param_byte(atcmd_stream_t *p_stream, char c)
+{
+	const atcmd_entry_t *p_entry = p_stream->p_entry;
+	uint8_t idx = p_stream->n_params;
 
-			if (j == buffer_len)
-				return false;
+	if (idx == p_entry->bulk)
+	{
+		if (p_stream->len >= p_entry->p_params[idx].max)
+		{
+			p_stream->state = ATCMD_STATE_ERROR;
+			return;
+		}
+		atcmd_bulk_buffer(p_stream, &p_entry->p_params[idx])[p_stream->len++] = c;
+		return;
+	}
 
-			memcpy(worddata, p_data + i, j - i);
-			if (!check_ascii_word(worddata, j - i))
-				return false;
+	if ((!p_entry->p_params[idx].is_str && (c < 0x30 || c > 0x39)) ||
+		p_stream->len >= APP_ATCMD_PARA_LENGTH - 1)
+	{
+		p_stream->state = ATCMD_STATE_ERROR;
+		return;
+	}
+	p_stream->param[idx][p_stream->len++] = c;
+	p_stream->param[idx][p_stream->len] = '\0';
+}
 
-			if (!m_scanint[0].is_str)
-			{
-				memcpy(m_scanner.scan_interval_str, worddata, j - i);
-				m_scanner.scan_interval_str[j-i] = '\0';
-				// Convert ascii to data.
-				scan_interval = ascii_to_word(worddata, j - i);
-			}
-			
-			// Get the next parameter, the 2-byte window value
-			i = j;
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
+static uint8_t atcmd_run_cmd(const atcmd_stream_t *p_stream)
+{	
+	const atcmd_entry_t *p_entry = p_stream->p_entry;
+	uint8_t delta[CONFIG_DELTA_MAX];
+	uint16_t len;
 
-			j = i;
-			while (*(p_data + j) != m_space &&
-			       *(p_data + j) != m_cr)
-				j++;			
+	switch (p_entry->action) {
+		case APP_ATCMD_ACT_CONFIG_SET :
+			if (!pstore_set((uint8_t *)m_configdata, m_scanner.config_size))
+				return APP_ATCMD_NOT_SUPPORTED;
+			break;
 
-			if (j == buffer_len)
-				return false;
+		case APP_ATCMD_ACT_CONFIG_CHUNK :
+			if (!pstore_chunk_write(m_scanner.chunk_offset, (uint8_t *)p_stream->bulk,
+			                        p_stream->bulk_len))
+				return APP_ATCMD_NOT_SUPPORTED;
+			break;
 
-			memcpy(worddata, p_data + i, j - i);
-			if (!check_ascii_word(worddata, j - i))
-				return false;
-			
-			if (!m_scanint[1].is_str)
-			{
-				memcpy(m_scanner.scan_window_str, worddata, j - i);
-				m_scanner.scan_window_str[j-i] = '\0';
-				// Convert ascii to data.
-				scan_window = ascii_to_word(worddata, j - i);
-			}
-			
-			if (scan_interval && scan_window)
-			{
-				m_scanner.scan_interval = scan_interval;
-				m_scanner.scan_window = scan_window;
-			}
-			else
-				return false;
+		case APP_ATCMD_ACT_CONFIG_COMMIT :
+			if (!pstore_chunk_commit(m_scanner.config_size, m_scanner.config_crc))
+				return APP_ATCMD_NOT_SUPPORTED;
+			break;
 
+		case APP_ATCMD_ACT_CONFIG_PATCH :
+			len = config_hdlr_delta_encode((uint8_t *)p_stream->bulk, p_stream->bulk_len, delta);
+			if (len == 0 || !pstore_patch(delta, len))
+				return APP_ATCMD_NOT_SUPPORTED;
 			break;
-			
-		case APP_ATCMD_ACT_ENABLE_SCAN_READ :
-		case APP_ATCMD_ACT_MODE_0_READ :
-		case APP_ATCMD_ACT_SCAN_INT_READ :
-		case APP_ATCMD_ACT_CONFIG_GET :
-		case APP_ATCMD_ACT_CONFIG_GET_VER :
+
+		default :
 			break;
-			
-		case APP_ATCMD_ACT_CONFIG_SET :
-			// Get the next parameter, the version string
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
+	}
+	return (p_entry->action);
+}
 
-			j = i;
-			while (*(p_data + j) != m_space &&
-			       *(p_data + j) != m_cr
-				   )
-				j++;			
+/**@brief Function to make a stream ready for the next command line.
+ *
+ * @param[in] p_stream  stream to reset.
+ */
+void atcmd_stream_reset(atcmd_stream_t *p_stream)
+{
+	if (m_bulk_owner == p_stream)
+		m_bulk_owner = NULL;
+
+	p_stream->state = ATCMD_STATE_CMD;
+	p_stream->len = 0;
+	p_stream->n_params = 0;
+	p_stream->bulk_len = 0;
+	p_stream->tag_len = 0;
+	p_stream->p_entry = NULL;
+}
 
-			if (j == buffer_len)
-				return false;
+/**@brief Function to feed one received byte into the command stream.
+ * @details The command and its parameters are split into the stream slots as
+ *          the bytes arrive, so nothing has to be rescanned once the line ends.
+ *
+ * @param[in] p_stream  stream the byte belongs to.
+ * @param[in] c         received byte.
+ *
+ * @return true when c terminated the line and atcmd_stream_run should be called.
+ */
+bool atcmd_stream_put(atcmd_stream_t *p_stream, char c)
+{
+	if (c == m_cr)
+	{
+		atcmd_stream_end_token(p_stream);
+		return true;
+	}
 
-			if (m_configdat[0].is_str)
+	switch (p_stream->state)
+	{
+		case ATCMD_STATE_CMD :
+			if (c == '#' && p_stream->len == 0 && p_stream->tag_len == 0)
 			{
-				memcpy(m_scanner.version_str, p_data + i, j - i);
+				p_stream->state = ATCMD_STATE_TAG;
 			}
-			
-			// Get the next parameter, the 2-byte config data size
-			i = j;
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
-
-			j = i;
-			while (*(p_data + j) != m_space &&
-			       *(p_data + j) != m_cr)
-				j++;			
-
-			if (j == buffer_len)
-				return false;
-
-			memcpy(worddata, p_data + i, j - i);
-			if (!check_ascii_word(worddata, j - i))
-				return false;
-			
-			if (!m_configdat[1].is_str)
+			else if (c == m_space)
 			{
-				memcpy(m_scanner.config_size_str, worddata, j - i);
-				m_scanner.config_size_str[j-i] = '\0';
-				// Convert ascii to data.
-				scan_window = ascii_to_word(worddata, j - i);
+				atcmd_stream_end_token(p_stream);
 			}
-			
-			if (scan_window)
+			else if (p_stream->len < APP_ATCMD_LENGTH)
 			{
-				m_scanner.config_size = scan_window;
+				p_stream->cmd[p_stream->len++] = c;
 			}
 			else
-				return false;
+				p_stream->state = ATCMD_STATE_ERROR;
+			break;
 
-			// Get the next parameter, the config data content
-			i = j;
-			while (*(p_data + i) == m_space &&
-			       i < buffer_len)
-				i++;
-				
-			if (i == buffer_len)
-				return false;
+		case ATCMD_STATE_GAP :
+			if (c == m_space)
+				break;
 
-			j = i;
-			while (*(p_data + j) != m_space &&
-			       *(p_data + j) != m_cr
-				   )
-				j++;			
+			// Parameters beyond the ones the command takes are ignored.
+			if (p_stream->n_params >= p_stream->p_entry->n_params)
+			{
+				p_stream->state = ATCMD_STATE_SKIP;
+				break;
+			}
+			if (p_stream->n_params == p_stream->p_entry->bulk &&
+				!atcmd_bulk_claim(p_stream))
+			{
+				p_stream->state = ATCMD_STATE_ERROR;
+				break;
+			}
+			p_stream->len = 0;
+			p_stream->state = ATCMD_STATE_PARAM;
+			atcmd_stream_param_byte(p_stream, c);
+			break;
 
-			if (j == buffer_len)
-				return false;
+		case ATCMD_STATE_PARAM :
+			if (c == m_space)
+				atcmd_stream_end_token(p_stream);
+			else
+				atcmd_stream_param_byte(p_stream, c);
+			break;
 
-			if (m_configdat[2].is_str)
+		case ATCMD_STATE_TAG :
+			if (c == m_space && p_stream->tag_len)
 			{
-				memcpy(m_configdata, p_data + i, j - i);
-			}			
-			
-			break;
-			
-		case APP_ATCMD_ACT_CONFIG_UPD :
-		case APP_ATCMD_ACT_CURRENT_TS :
-		case APP_ATCMD_ACT_LAST_SENTENCE :
+				p_stream->state = ATCMD_STATE_CMD;
+			}
+			else if (c >= 0x30 && c <= 0x39 && p_stream->tag_len < APP_ATCMD_TAG_MAX)
+			{
+				p_stream->tag[p_stream->tag_len++] = c;
+				p_stream->tag[p_stream->tag_len] = '\0';
+			}
+			else
+				p_stream->state = ATCMD_STATE_ERROR;
 			break;
-			
+
 		default :
 			break;
 	}
-	return true;
+	return false;
 }
 
-static uint8_t atcmd_run_cmd()
-{	
-	uint8_t rc = APP_ATCMD_NOT_SUPPORTED;
-	
-	switch (atcmd_match_cmd()) {
-		case APP_ATCMD_ACT_ENABLE_SCAN :
-			rc = APP_ATCMD_ACT_ENABLE_SCAN;
-			break;
+/**@brief Function to load a binary command into the stream.
+ * @details Each TLV carries one parameter, its type being the parameter index.
+ *          Numbers are little endian, 1 to 4 bytes, and are turned into digits
+ *          so they go through the same descriptor checks as the AT text. The
+ *          bulk parameter may be split over several TLVs. Run the stream with
+ *          atcmd_stream_run afterwards, a malformed frame then gives a NACK.
+ *
+ * @param[in] p_stream  stream to load, reset first.
+ * @param[in] action    APP_ATCMD_ACT_xxx code of the command.
+ * @param[in] p_tlv     TLV parameters.
+ * @param[in] len       size, in bytes, of the TLV parameters.
+ */
+void atcmd_stream_load(atcmd_stream_t *p_stream, uint8_t action, const uint8_t *p_tlv, uint16_t len)
+{
+	const atcmd_entry_t *p_entry;
+	const atcmd_param_desc_t *p_desc;
+	uint16_t i = 0;
+	uint32_t value;
+	uint8_t seen = 0;
+	uint8_t type;
+	uint8_t tlv_len;
+	uint8_t j;
+
+	atcmd_stream_reset(p_stream);
+	p_stream->state = ATCMD_STATE_ERROR;
+	if (action >= APP_ATCMD_ACT_COUNT || m_atcmd_action[action] == ATCMD_INDEX_NONE)
+		return;
+
+	p_entry = &m_atcmds[m_atcmd_action[action]];
+	p_stream->p_entry = p_entry;
+	while (i + 2 <= len)
+	{
+		type = p_tlv[i];
+		tlv_len = p_tlv[i + 1];
+		i += 2;
+		if (i + tlv_len > len || type >= p_entry->n_params)
+			return;
+
+		p_desc = &p_entry->p_params[type];
+		if (type == p_entry->bulk)
+		{
+			if (!atcmd_bulk_claim(p_stream) ||
+				p_stream->bulk_len + tlv_len > p_desc->max)
+				return;
+			memcpy(atcmd_bulk_buffer(p_stream, p_desc) + p_stream->bulk_len, p_tlv + i, tlv_len);
+			p_stream->bulk_len += tlv_len;
+		}
+		else if (p_desc->is_str)
+		{
+			if (tlv_len >= APP_ATCMD_PARA_LENGTH)
+				return;
+			memcpy(p_stream->param[type], p_tlv + i, tlv_len);
+			p_stream->param[type][tlv_len] = '\0';
+			p_stream->param_len[type] = tlv_len;
+		}
+		else
+		{
+			if (tlv_len == 0 || tlv_len > sizeof(uint32_t))
+				return;
+			value = 0;
+			for (j = tlv_len; j > 0; j--)
+				value = (value << 8) | p_tlv[i + j - 1];
+			p_stream->param_len[type] = longword_to_ascii((uint8_t *)p_stream->param[type], value);
+			p_stream->param[type][p_stream->param_len[type]] = '\0';
+		}
+		seen |= 1 << type;
+		i += tlv_len;
+	}
 
-		case APP_ATCMD_ACT_MODE_0 :
-			rc = APP_ATCMD_ACT_MODE_0;
-			break;
+	// Every parameter must be present and nothing may trail the last TLV.
+	if (i != len || seen != (1 << p_entry->n_params) - 1)
+		return;
 
-		case APP_ATCMD_ACT_SCAN_INT :
-			rc = APP_ATCMD_ACT_SCAN_INT;
-			break;
-			
-		case APP_ATCMD_ACT_ENABLE_SCAN_READ :
-			rc = APP_ATCMD_ACT_ENABLE_SCAN_READ;
-			break;
-			
-		case APP_ATCMD_ACT_MODE_0_READ :
-			rc = APP_ATCMD_ACT_MODE_0_READ;
-			break;
-			
-		case APP_ATCMD_ACT_SCAN_INT_READ :
-			rc = APP_ATCMD_ACT_SCAN_INT_READ;
-			break;
+	p_stream->n_params = p_entry->n_params;
+	p_stream->state = ATCMD_STATE_GAP;
+}
 
-		case APP_ATCMD_ACT_CONFIG_GET :
-			rc = APP_ATCMD_ACT_CONFIG_GET;
-			break;
-			
-		case APP_ATCMD_ACT_CONFIG_SET :
-			pstore_set((uint8_t *)m_configdata, m_scanner.config_size);
-			rc = APP_ATCMD_ACT_CONFIG_SET;
-			break;
+/**@brief Function to get the command a complete stream is going to run.
+ *
+ * @return the APP_ATCMD_ACT_xxx code or APP_ATCMD_NOT_SUPPORTED for a rejected line.
+ */
+uint8_t atcmd_stream_action(const atcmd_stream_t *p_stream)
+{
+	if (p_stream->state == ATCMD_STATE_ERROR || p_stream->p_entry == NULL)
+		return APP_ATCMD_NOT_SUPPORTED;
 
-		case APP_ATCMD_ACT_CONFIG_GET_VER :
-			rc = APP_ATCMD_ACT_CONFIG_GET_VER;
-			break;
-			
-		case APP_ATCMD_ACT_CONFIG_UPD :
-			rc = APP_ATCMD_ACT_CONFIG_UPD;
-			break;
+	return (p_stream->p_entry->action);
+}
 
-		case APP_ATCMD_ACT_CURRENT_TS :
-			rc = APP_ATCMD_ACT_CURRENT_TS;
-			break;
-			
-		case APP_ATCMD_ACT_LAST_SENTENCE :
-			rc = APP_ATCMD_ACT_LAST_SENTENCE;
-			break;
-			
-		default :
-			break;
+/**@brief Function to queue a complete stream for the main loop.
+ * @details The stream is copied, bulk buffer ownership included, and reset for
+ *          the next line. Call from the interface event handlers only.
+ *
+ * @param[in] p_stream  complete stream, loaded or terminated by \r.
+ * @param[in] source    APP_ATCMD_SRC_xxx of the interface.
+ * @param[in] opcode    binary opcode or APP_ATCMD_OPCODE_TEXT.
+ *
+ * @return false if the queue is full, the line is then dropped.
+ */
+bool atcmd_queue_push(atcmd_stream_t *p_stream, uint8_t source, uint8_t opcode)
+{
+	atcmd_queue_item_t *p_item;
+
+	if ((uint8_t)(m_queue_head - m_queue_tail) >= APP_ATCMD_QUEUE_LEN)
+	{
+		atcmd_stream_reset(p_stream);
+		return false;
+	}
+
+	p_item = &m_queue[m_queue_head % APP_ATCMD_QUEUE_LEN];
+	memcpy(&p_item->stream, p_stream, sizeof(atcmd_stream_t));
+	if (m_bulk_owner == p_stream)
+		m_bulk_owner = &p_item->stream;
+	p_item->source = source;
+	p_item->opcode = opcode;
+	m_queue_head++;
+
+	atcmd_stream_reset(p_stream);
+	return true;
+}
+
+/**@brief Function to get the oldest queued command.
+ *
+ * @return the queued command or NULL if the queue is empty.
+ */
+atcmd_queue_item_t *atcmd_queue_peek(void)
+{
+	if (m_queue_head == m_queue_tail)
+		return NULL;
+
+	return (&m_queue[m_queue_tail % APP_ATCMD_QUEUE_LEN]);
+}
+
+/**@brief Function to release the oldest queued command once it has been executed.
+ */
+void atcmd_queue_pop(void)
+{
+	if (m_queue_head != m_queue_tail)
+		m_queue_tail++;
+}
+
+/**@brief Function to execute the command line collected by the stream.
+ * @details The stream is reset and ready for the next line on return.
+ *
+ * @param[in] p_stream  stream whose line has been terminated.
+ *
+ * @return the APP_ATCMD_ACT_xxx code or APP_ATCMD_NOT_SUPPORTED.
+ */
+uint8_t atcmd_stream_run(atcmd_stream_t *p_stream)
+{
+	const atcmd_entry_t *p_entry = p_stream->p_entry;
+	uint8_t rc = APP_ATCMD_NOT_SUPPORTED;
+
+	if (p_stream->state != ATCMD_STATE_ERROR &&
+		p_entry != NULL &&
+		p_stream->n_params >= p_entry->n_params &&
+		atcmd_param_store(p_stream))
+	{
+		rc = atcmd_run_cmd(p_stream);
 	}
+	atcmd_stream_reset(p_stream);
 	return (rc);
 }
 
 /**@brief Function to initialize the at command tables.
+ * @details Must be called before the UART and NUS deliver the first byte, the
+ *          lookups run from their interrupts.
  */
 void atcmd_init(void)
 {
-	memset(m_atcmd_cur, 0, APP_ATCMD_LENGTH);
-	memset(m_atcmd_param, 0, APP_ATCMD_PARA_MAX * APP_ATCMD_PARA_LENGTH);
+	atcmd_index_init();
 	m_scanner.scan_interval = 0x00A0;
 	m_scanner.scan_window = 0x0050;
 	m_scanner.mode = 0;
-	m_scanner.mode_byte = '0';
 	m_scanner.enable = 1;
-	m_scanner.enable_byte = '0';
 	strcpy(m_scanner.building_code, m_def_building_code);
 	m_scanner.config_size = 0;
 	memset(m_configdata, 0, PSTORE_MAX_BLOCK);
@@ -395,26 +662,20 @@ void atcmd_init(void)
 	memset(m_scanner.config_size_str, 0, APP_WORD_STR_LEN);
 }
 
-/**@brief Function to store the current at command in the at command table.
- * @details Use the built-in h/w encryption engine.
- * 
- * @param[in] p_data  pointer to the at command in the raw data buffer.
- * @param[in] cmd_len  size, in bytes, of the current at command.
- */
-uint8_t atcmd_parse(uint16_t buffer_len, char *p_data)
-{
-	if (atcmd_extract_cmd(buffer_len, p_data))
-		return (atcmd_run_cmd());
-	else
-		return APP_ATCMD_NOT_SUPPORTED;
-}
-
 void atcmd_get_scan_param(uint16_t *p_interval, uint16_t *p_window)
 {
 	*p_interval = m_scanner.scan_interval;
 	*p_window = m_scanner.scan_window;
 }
 
+/**@brief Function to get the UART settings of the last at$baud command.
+ */
+void atcmd_get_baud(uint32_t *p_baud_rate, bool *p_flow_control)
+{
+	*p_baud_rate = m_scanner.baud_rate;
+	*p_flow_control = (m_scanner.flow_control != 0);
+}
+
 uint8_t atcmd_scan_enabled(void)
 {
 	return (m_scanner.enable);
@@ -422,12 +683,12 @@ uint8_t atcmd_scan_enabled(void)
 
 char atcmd_get_enable(void)
 {
-	return (m_scanner.enable_byte);
+	return (m_scanner.enable + ZERO);
 }
 
 char atcmd_get_mode(void)
 {
-	return (m_scanner.mode_byte);
+	return (m_scanner.mode + ZERO);
 }
 
 char *atcmd_get_interval(void)
@@ -440,25 +701,6 @@ char *atcmd_get_window(void)
 	return (m_scanner.scan_window_str);
 }
 
-/**@brief Function to store the current at command in the at command table.
- * @details Use the built-in h/w encryption engine.
- * 
- * @param[in] p_data  pointer to the at command in the raw data buffer.
- * @param[in] cmd_len  size, in bytes, of the current at command.
- *
- * @Warning This routine may cause the watchdog timer to reset if the config data
- *          is more than 128 bytes. For a huge config data use the scheduler to
- *          send the data instead.
- */
-char *atcmd_reply_config(void)
-{
-	uint16_t config_size;
-	
-	config_size = pstore_get((uint8_t *)m_configdata);
-	m_configdata[config_size] = 0x00;
-    return (m_configdata);
-}
-
 /**@brief Function to store the current at command in the at command table.
  * @details Use the built-in h/w encryption engine.
  * 
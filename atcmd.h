@@ -4,7 +4,7 @@
 										
 #define APP_ATCMD_LENGTH        0x10
 #define APP_ATCMD_SENTENCE_LEN  0x40
-#define APP_ATCMD_PARA_LENGTH	0X10
+#define APP_ATCMD_PARA_LENGTH	0X20
 #define APP_ATCMD_PARA_MAX   	4
 
 #define APP_ATCMD_ACT_ENABLE_SCAN 		0
@@ -19,20 +19,41 @@
 #define APP_ATCMD_ACT_CONFIG_UPD        9
 #define APP_ATCMD_ACT_CURRENT_TS       10
 #define APP_ATCMD_ACT_LAST_SENTENCE    11
+#define APP_ATCMD_ACT_BOOT_TS          12
+#define APP_ATCMD_ACT_CONFIG_CHUNK     13
+#define APP_ATCMD_ACT_CONFIG_COMMIT    14
+#define APP_ATCMD_ACT_BIN_MODE         15
+#define APP_ATCMD_ACT_BAUD             16
+#define APP_ATCMD_ACT_CONFIG_PATCH     17
+#define APP_ATCMD_ACT_COUNT            18
+#define APP_ATCMD_OPCODE_TEXT        0xff   // queued command came as an AT text line
 #define APP_ATCMD_NOT_SUPPORTED     0xff
 
 #define APP_BUILDING_CODE_LENGTH	0X10
 #define APP_WORD_STR_LEN			6  // 5 characters + the \0
 #define APP_VERSION_STR_MAX         32
 #define APP_ATCMD_MAX_DATA_LEN      1024
+#define APP_ATCMD_BULK_LEN          64    // bulk parameter kept in the stream, one config chunk
+#define APP_ATCMD_TAG_MAX           5     // digits of a sequence tag
+#define APP_ATCMD_QUEUE_LEN         4     // commands waiting for the main loop, power of 2
+
+#define APP_ATCMD_SRC_UART          0
+#define APP_ATCMD_SRC_NUS           1
+#define APP_ATCMD_SRC_COUNT         2
+
+#define ATCMD_STATE_CMD     0   // collecting the command
+#define ATCMD_STATE_GAP     1   // skipping white space before a parameter
+#define ATCMD_STATE_PARAM   2   // collecting a parameter
+#define ATCMD_STATE_SKIP    3   // ignoring surplus parameters up to the \r
+#define ATCMD_STATE_ERROR   4   // line rejected, waiting for the \r
+#define ATCMD_STATE_TAG     5   // collecting the #<tag> in front of the command
+#define ATCMD_NO_BULK       0xff
 
 typedef struct
 {
 	char		building_code[APP_BUILDING_CODE_LENGTH];
 	char		scan_interval_str[APP_WORD_STR_LEN];
 	char		scan_window_str[APP_WORD_STR_LEN];
-	char		mode_byte;
-	char		enable_byte;
 	uint16_t	scan_interval;
 	uint16_t 	scan_window;
 	uint8_t		mode;
@@ -40,24 +61,73 @@ typedef struct
 	char        version_str[APP_VERSION_STR_MAX];
 	uint16_t    config_size;
 	char		config_size_str[APP_WORD_STR_LEN];
+	uint16_t	chunk_offset;
+	uint16_t	config_crc;
+	uint32_t	baud_rate;
+	uint8_t		flow_control;
 } atcmd_data_t;
 
 typedef struct
 {
 	uint8_t		is_str; // 1 => treat as string, 0 => treat as unsigned number
-	uint8_t		size; // parameter size in number of bytes
+	uint8_t		size; // parameter size in number of bytes, string size including the \0
+	uint32_t	min;  // accepted range of a number
+	uint32_t	max;  // or size of the buffer of a streamed parameter
+	void		*p_dest; // typed destination field, or buffer of a streamed parameter
+	char		*p_text; // optional copy of the number digits
 } atcmd_param_desc_t;
 
+typedef struct atcmd_stream_s atcmd_stream_t;
+
+typedef struct
+{
+	const char					*p_cmd;
+	uint8_t						len;        // command length without the \0
+	uint8_t						action;     // APP_ATCMD_ACT_xxx returned to the caller
+	const atcmd_param_desc_t	*p_params;  // parameter descriptors
+	uint8_t						n_params;
+	uint8_t						bulk;       // parameter streamed into a bulk buffer
+} atcmd_entry_t;
+
+struct atcmd_stream_s
+{
+	uint8_t						state;
+	uint16_t					len;        // bytes in the current token
+	uint8_t						n_params;
+	char						cmd[APP_ATCMD_LENGTH];
+	char						param[APP_ATCMD_PARA_MAX][APP_ATCMD_PARA_LENGTH];
+	uint8_t						param_len[APP_ATCMD_PARA_MAX];
+	uint16_t					bulk_len;   // bytes streamed into the bulk buffer
+	char						bulk[APP_ATCMD_BULK_LEN];
+	char						tag[APP_WORD_STR_LEN];
+	uint8_t						tag_len;
+	const atcmd_entry_t			*p_entry;
+};
+
+typedef struct
+{
+	atcmd_stream_t				stream;
+	uint8_t						source;     // APP_ATCMD_SRC_xxx the reply goes to
+	uint8_t						opcode;     // binary opcode or APP_ATCMD_OPCODE_TEXT
+} atcmd_queue_item_t;
+
 void atcmd_init(void);
-uint8_t atcmd_parse(uint16_t buffer_len, char *p_data);
+void atcmd_stream_reset(atcmd_stream_t *p_stream);
+bool atcmd_stream_put(atcmd_stream_t *p_stream, char c);
+uint8_t atcmd_stream_run(atcmd_stream_t *p_stream);
+void atcmd_stream_load(atcmd_stream_t *p_stream, uint8_t action, const uint8_t *p_tlv, uint16_t len);
+uint8_t atcmd_stream_action(const atcmd_stream_t *p_stream);
+bool atcmd_queue_push(atcmd_stream_t *p_stream, uint8_t source, uint8_t opcode);
+atcmd_queue_item_t *atcmd_queue_peek(void);
+void atcmd_queue_pop(void);
 void atcmd_get_scan_param(uint16_t *p_interval, uint16_t *p_window);
+void atcmd_get_baud(uint32_t *p_baud_rate, bool *p_flow_control);
 uint8_t atcmd_scan_enabled(void);
 char atcmd_get_enable(void);
 char atcmd_get_mode(void);
 char *atcmd_get_interval(void);
 char *atcmd_get_window(void);
 
-char *atcmd_reply_config(void);
 char *atcmd_get_ok(void);
 char *atcmd_get_nack(void);
 char *atcmd_get_in(void);
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "atresp.h"
+
+/**@brief Function to start an empty reply.
+ *
+ * @param[in] p_resp  reply to clear.
+ */
+void atresp_init(atresp_t *p_resp)
+{
+	p_resp->n_segs = 0;
+	p_resp->len = 0;
+	p_resp->scratch_len = 0;
+}
+
+/**@brief Function to append a segment to the reply by reference.
+ * @details The data is not copied, it must stay valid until the reply is sent.
+ *          A segment following the previous one in memory extends it. Segments
+ *          beyond ATRESP_MAX_SEGS are dropped.
+ *
+ * @param[in] p_resp  reply to append to.
+ * @param[in] p_data  segment data.
+ * @param[in] len     size, in bytes, of the segment.
+ */
+void atresp_add(atresp_t *p_resp, const void *p_data, uint16_t len)
+{
+	atresp_seg_t *p_last;
+
+	if (len == 0)
+		return;
+
+	p_last = (p_resp->n_segs) ? &p_resp->seg[p_resp->n_segs - 1] : NULL;
+	if (p_last != NULL && p_last->p_data + p_last->len == (const uint8_t *)p_data)
+	{
+		p_last->len += len;
+	}
+	else if (p_resp->n_segs < ATRESP_MAX_SEGS)
+	{
+		p_resp->seg[p_resp->n_segs].p_data = p_data;
+		p_resp->seg[p_resp->n_segs].len = len;
+		p_resp->n_segs++;
+	}
+	else
+		return;
+
+	p_resp->len += len;
+}
+
+/**@brief Function to append a constant string to the reply by reference.
+ */
+void atresp_add_str(atresp_t *p_resp, const char *p_str)
+{
+	atresp_add(p_resp, p_str, strlen(p_str));
+}
+
+/**@brief Function to get scratch room for a field formatted in place.
+ * @details Format the field at the returned pointer, then call atresp_commit
+ *          with the number of bytes actually written.
+ *
+ * @param[in] p_resp  reply the field belongs to.
+ * @param[in] len     largest size, in bytes, the field may take.
+ *
+ * @return room for the field or NULL if the scratch area is full.
+ */
+uint8_t *atresp_reserve(atresp_t *p_resp, uint16_t len)
+{
+	if (p_resp->scratch_len + len > ATRESP_SCRATCH_LEN)
+		return NULL;
+
+	return (&p_resp->scratch[p_resp->scratch_len]);
+}
+
+/**@brief Function to append the field formatted at the last reserved room.
+ *
+ * @param[in] p_resp  reply the field belongs to.
+ * @param[in] len     size, in bytes, of the field.
+ */
+void atresp_commit(atresp_t *p_resp, uint16_t len)
+{
+	atresp_add(p_resp, &p_resp->scratch[p_resp->scratch_len], len);
+	p_resp->scratch_len += len;
+}
+
+/**@brief Function to copy the reply into one buffer, for the interfaces that frame it.
+ *
+ * @return size, in bytes, copied to p_dest.
+ */
+uint16_t atresp_flatten(const atresp_t *p_resp, uint8_t *p_dest, uint16_t max)
+{
+	uint16_t len = 0;
+	uint16_t n;
+	uint8_t i;
+
+	for (i = 0; i < p_resp->n_segs && len < max; i++)
+	{
+		n = p_resp->seg[i].len;
+		if (n > max - len)
+			n = max - len;
+		memcpy(p_dest + len, p_resp->seg[i].p_data, n);
+		len += n;
+	}
+	return (len);
+}
@@ -0,0 +1,29 @@
+#ifndef ATRESP_H__
+#define ATRESP_H__
+
+#define ATRESP_MAX_SEGS         6
+#define ATRESP_SCRATCH_LEN      80     // room for the fields formatted in place, boot timestamps
+
+typedef struct
+{
+	const uint8_t	*p_data;
+	uint16_t		len;
+} atresp_seg_t;
+
+typedef struct
+{
+	atresp_seg_t	seg[ATRESP_MAX_SEGS];
+	uint8_t			n_segs;
+	uint16_t		len;            // total bytes in all segments
+	uint16_t		scratch_len;    // scratch bytes already committed
+	uint8_t			scratch[ATRESP_SCRATCH_LEN];
+} atresp_t;
+
+void atresp_init(atresp_t *p_resp);
+void atresp_add(atresp_t *p_resp, const void *p_data, uint16_t len);
+void atresp_add_str(atresp_t *p_resp, const char *p_str);
+uint8_t *atresp_reserve(atresp_t *p_resp, uint16_t len);
+void atresp_commit(atresp_t *p_resp, uint16_t len);
+uint16_t atresp_flatten(const atresp_t *p_resp, uint8_t *p_dest, uint16_t max);
+
+#endif  /* _ ATRESP_H__ */
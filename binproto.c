@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+
+#include "binproto.h"
+
+#define BINPROTO_COBS_MAX_CODE  0xFF
+
+/**@brief Function to make a receiver ready for the next frame.
+ *
+ * @param[in] p_rx  receiver to reset.
+ */
+void binproto_reset(binproto_rx_t *p_rx)
+{
+	p_rx->len = 0;
+	p_rx->code = BINPROTO_COBS_MAX_CODE;
+	p_rx->left = 0;
+	p_rx->error = false;
+	p_rx->ready = false;
+}
+
+/**@brief Function to feed one received byte into the COBS frame decoder.
+ * @details The frame is decoded while it arrives. On the delimiter the CRC is
+ *          checked and removed, leaving the opcode and TLVs in p_rx->buf.
+ *
+ * @param[in] p_rx  receiver the byte belongs to.
+ * @param[in] data  received byte.
+ *
+ * @return true when a complete frame with a valid CRC is in p_rx->buf. It stays
+ *         there until the next byte is fed in.
+ */
+bool binproto_put(binproto_rx_t *p_rx, uint8_t data)
+{
+	uint16_t crc;
+
+	if (p_rx->ready)
+		binproto_reset(p_rx);
+
+	if (data == BINPROTO_DELIMITER)
+	{
+		// The implicit zero closing the last block is not part of the frame.
+		if (p_rx->error || p_rx->left || p_rx->len <= BINPROTO_CRC_LENGTH)
+		{
+			binproto_reset(p_rx);
+			return false;
+		}
+		p_rx->len -= BINPROTO_CRC_LENGTH;
+		crc = p_rx->buf[p_rx->len] | (p_rx->buf[p_rx->len + 1] << 8);
+		if (crc16_ccitt(p_rx->buf, p_rx->len, CRC16_CCITT_INIT) != crc)
+		{
+			binproto_reset(p_rx);
+			return false;
+		}
+		p_rx->ready = true;
+		return true;
+	}
+
+	if (p_rx->error)
+		return false;
+
+	if (p_rx->left == 0)
+	{
+		// Code byte. Every block but a full one is followed by a zero.
+		if (p_rx->code != BINPROTO_COBS_MAX_CODE)
+		{
+			if (p_rx->len >= BINPROTO_MAX_FRAME)
+			{
+				p_rx->error = true;
+				return false;
+			}
+			p_rx->buf[p_rx->len++] = 0;
+		}
+		p_rx->code = data;
+		p_rx->left = data - 1;
+		return false;
+	}
+
+	if (p_rx->len >= BINPROTO_MAX_FRAME)
+	{
+		p_rx->error = true;
+		return false;
+	}
+	p_rx->buf[p_rx->len++] = data;
+	p_rx->left--;
+	return false;
+}
+
+/**@brief Function to append one TLV to a payload.
+ *
+ * @return size, in bytes, of the TLV.
+ */
+uint16_t binproto_tlv_put(uint8_t *p_tlv, uint8_t type, const uint8_t *p_value, uint8_t len)
+{
+	p_tlv[0] = type;
+	p_tlv[1] = len;
+	memcpy(p_tlv + 2, p_value, len);
+	return (len + 2);
+}
+
+/**@brief Function to build a COBS encoded frame, delimiter included.
+ *
+ * @param[in]  opcode   frame opcode.
+ * @param[in]  p_tlv    TLV payload.
+ * @param[in]  tlv_len  size, in bytes, of the payload. Truncated to fit a frame.
+ * @param[out] p_out    encoded frame, BINPROTO_MAX_ENCODED bytes.
+ *
+ * @return size, in bytes, of the encoded frame.
+ */
+uint16_t binproto_build(uint8_t opcode, const uint8_t *p_tlv, uint16_t tlv_len, uint8_t *p_out)
+{
+	uint16_t crc;
+	uint16_t len;
+	uint16_t i;
+	uint16_t code_idx = 0;
+	uint16_t out_len = 1;
+	uint8_t code = 1;
+	uint8_t data;
+
+	if (tlv_len > BINPROTO_MAX_FRAME - 1 - BINPROTO_CRC_LENGTH)
+		tlv_len = BINPROTO_MAX_FRAME - 1 - BINPROTO_CRC_LENGTH;
+
+	crc = crc16_ccitt(&opcode, 1, CRC16_CCITT_INIT);
+	crc = crc16_ccitt(p_tlv, tlv_len, crc);
+	len = 1 + tlv_len + BINPROTO_CRC_LENGTH;
+
+	for (i = 0; i < len; i++)
+	{
+		if (i == 0)
+			data = opcode;
+		else if (i <= tlv_len)
+			data = p_tlv[i - 1];
+		else if (i == tlv_len + 1)
+			data = (uint8_t)crc;
+		else
+			data = (uint8_t)(crc >> 8);
+
+		if (data != 0)
+		{
+			p_out[out_len++] = data;
+			code++;
+		}
+		if (data == 0 || code == BINPROTO_COBS_MAX_CODE)
+		{
+			p_out[code_idx] = code;
+			code_idx = out_len++;
+			code = 1;
+		}
+	}
+	p_out[code_idx] = code;
+	p_out[out_len++] = BINPROTO_DELIMITER;
+	return (out_len);
+}
@@ -0,0 +1,28 @@
+#ifndef BINPROTO_H__
+#define BINPROTO_H__
+
+#define BINPROTO_MAX_FRAME      128    // decoded frame: opcode, TLVs and CRC
+#define BINPROTO_MAX_ENCODED    (BINPROTO_MAX_FRAME + BINPROTO_MAX_FRAME / 254 + 2)
+#define BINPROTO_CRC_LENGTH     2      // CRC-16/CCITT, LSB first
+#define BINPROTO_DELIMITER      0x00
+
+#define BINPROTO_OP_TEXT_MODE   0x7F   // leave the binary mode, back to AT commands
+#define BINPROTO_TLV_REPLY      0x80   // reply text of the command
+#define BINPROTO_TLV_STATUS     0x81   // 0 => command done, 1 => rejected
+
+typedef struct
+{
+	uint8_t		buf[BINPROTO_MAX_FRAME];
+	uint16_t	len;        // decoded bytes
+	uint8_t		code;       // current COBS code byte
+	uint8_t		left;       // bytes left in the current COBS block
+	bool		error;      // frame overflow, dropped at the next delimiter
+	bool		ready;      // buf holds a delivered frame
+} binproto_rx_t;
+
+void binproto_reset(binproto_rx_t *p_rx);
+bool binproto_put(binproto_rx_t *p_rx, uint8_t data);
+uint16_t binproto_build(uint8_t opcode, const uint8_t *p_tlv, uint16_t tlv_len, uint8_t *p_out);
+uint16_t binproto_tlv_put(uint8_t *p_tlv, uint8_t type, const uint8_t *p_value, uint8_t len);
+
+#endif  /* _ BINPROTO_H__ */
@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "ble.h"
+#include "ble_srv_common.h"
+#include "ble_cfg.h"
+
+// Base UUID of the config transfer service: 5A1E0000-4F3B-4C8A-9E21-7D0C6B1F2E40.
+static const ble_uuid128_t m_cfg_base_uuid =
+{
+	{0x40, 0x2E, 0x1F, 0x6B, 0x0C, 0x7D, 0x21, 0x9E, 0x8A, 0x4C, 0x3B, 0x4F, 0x00, 0x00, 0x1E, 0x5A}
+};
+
+/**@brief Function to add the data characteristic, written without response by the central.
+ */
+static uint32_t ble_cfg_data_char_add(ble_cfg_t *p_cfg)
+{
+	ble_gatts_char_md_t char_md;
+	ble_gatts_attr_md_t attr_md;
+	ble_gatts_attr_t    attr_char_value;
+	ble_uuid_t          ble_uuid;
+
+	memset(&char_md, 0, sizeof(char_md));
+	char_md.char_props.write_wo_resp = 1;
+
+	memset(&attr_md, 0, sizeof(attr_md));
+	BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+	BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+	attr_md.vloc = BLE_GATTS_VLOC_STACK;
+	attr_md.vlen = 1;
+
+	ble_uuid.type = p_cfg->uuid_type;
+	ble_uuid.uuid = BLE_UUID_CFG_DATA_CHARACTERISTIC;
+
+	memset(&attr_char_value, 0, sizeof(attr_char_value));
+	attr_char_value.p_uuid    = &ble_uuid;
+	attr_char_value.p_attr_md = &attr_md;
+	attr_char_value.init_len  = 1;
+	attr_char_value.max_len   = BLE_CFG_MAX_DATA_LEN;
+
+	return sd_ble_gatts_characteristic_add(p_cfg->service_handle, &char_md,
+	                                       &attr_char_value, &p_cfg->data_handles);
+}
+
+/**@brief Function to add the status characteristic, notified to the central.
+ */
+static uint32_t ble_cfg_status_char_add(ble_cfg_t *p_cfg)
+{
+	ble_gatts_char_md_t char_md;
+	ble_gatts_attr_md_t cccd_md;
+	ble_gatts_attr_md_t attr_md;
+	ble_gatts_attr_t    attr_char_value;
+	ble_uuid_t          ble_uuid;
+
+	memset(&cccd_md, 0, sizeof(cccd_md));
+	BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+	BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+	cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+	memset(&char_md, 0, sizeof(char_md));
+	char_md.char_props.notify = 1;
+	char_md.p_cccd_md         = &cccd_md;
+
+	memset(&attr_md, 0, sizeof(attr_md));
+	BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+	BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+	attr_md.vloc = BLE_GATTS_VLOC_STACK;
+
+	ble_uuid.type = p_cfg->uuid_type;
+	ble_uuid.uuid = BLE_UUID_CFG_STATUS_CHARACTERISTIC;
+
+	memset(&attr_char_value, 0, sizeof(attr_char_value));
+	attr_char_value.p_uuid    = &ble_uuid;
+	attr_char_value.p_attr_md = &attr_md;
+	attr_char_value.init_len  = BLE_CFG_STATUS_LEN;
+	attr_char_value.max_len   = BLE_CFG_STATUS_LEN;
+
+	return sd_ble_gatts_characteristic_add(p_cfg->service_handle, &char_md,
+	                                       &attr_char_value, &p_cfg->status_handles);
+}
+
+/**@brief Function to add the config transfer service to the GATT table.
+ *
+ * @param[out] p_cfg       service instance.
+ * @param[in]  p_cfg_init  handler of the data writes.
+ *
+ * @return NRF_SUCCESS or the error of the SoftDevice.
+ */
+uint32_t ble_cfg_init(ble_cfg_t *p_cfg, const ble_cfg_init_t *p_cfg_init)
+{
+	ble_uuid_t ble_uuid;
+	uint32_t err_code;
+
+	p_cfg->conn_handle = BLE_CONN_HANDLE_INVALID;
+	p_cfg->is_notification_enabled = false;
+	p_cfg->data_handler = p_cfg_init->data_handler;
+
+	err_code = sd_ble_uuid_vs_add(&m_cfg_base_uuid, &p_cfg->uuid_type);
+	if (err_code != NRF_SUCCESS)
+		return (err_code);
+
+	ble_uuid.type = p_cfg->uuid_type;
+	ble_uuid.uuid = BLE_UUID_CFG_SERVICE;
+	err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY, &ble_uuid, &p_cfg->service_handle);
+	if (err_code != NRF_SUCCESS)
+		return (err_code);
+
+	err_code = ble_cfg_data_char_add(p_cfg);
+	if (err_code != NRF_SUCCESS)
+		return (err_code);
+
+	return (ble_cfg_status_char_add(p_cfg));
+}
+
+/**@brief Function for handling the BLE events of the config transfer service.
+ */
+void ble_cfg_on_ble_evt(ble_cfg_t *p_cfg, ble_evt_t *p_ble_evt)
+{
+	ble_gatts_evt_write_t *p_write;
+
+	switch (p_ble_evt->header.evt_id)
+	{
+		case BLE_GAP_EVT_CONNECTED:
+			p_cfg->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+			break;
+
+		case BLE_GAP_EVT_DISCONNECTED:
+			p_cfg->conn_handle = BLE_CONN_HANDLE_INVALID;
+			p_cfg->is_notification_enabled = false;
+			break;
+
+		case BLE_GATTS_EVT_WRITE:
+			p_write = &p_ble_evt->evt.gatts_evt.params.write;
+			if (p_write->handle == p_cfg->status_handles.cccd_handle && p_write->len == 2)
+			{
+				p_cfg->is_notification_enabled = ble_srv_is_notification_enabled(p_write->data);
+			}
+			else if (p_write->handle == p_cfg->data_handles.value_handle &&
+			         p_cfg->data_handler != NULL)
+			{
+				p_cfg->data_handler(p_cfg, p_write->data, p_write->len);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**@brief Function to notify the result of a chunk or commit.
+ *
+ * @param[in] p_cfg   service instance.
+ * @param[in] op      BLE_CFG_OP_xxx being answered.
+ * @param[in] status  BLE_CFG_STATUS_xxx.
+ * @param[in] offset  next config offset expected by the device.
+ *
+ * @return NRF_SUCCESS or the error of the SoftDevice.
+ */
+uint32_t ble_cfg_status_send(ble_cfg_t *p_cfg, uint8_t op, uint8_t status, uint16_t offset)
+{
+	ble_gatts_hvx_params_t hvx_params;
+	uint8_t value[BLE_CFG_STATUS_LEN];
+	uint16_t len = BLE_CFG_STATUS_LEN;
+
+	if (p_cfg->conn_handle == BLE_CONN_HANDLE_INVALID || !p_cfg->is_notification_enabled)
+		return (NRF_ERROR_INVALID_STATE);
+
+	value[0] = op;
+	value[1] = status;
+	value[2] = (uint8_t)offset;
+	value[3] = (uint8_t)(offset >> 8);
+
+	memset(&hvx_params, 0, sizeof(hvx_params));
+	hvx_params.handle = p_cfg->status_handles.value_handle;
+	hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+	hvx_params.p_len  = &len;
+	hvx_params.p_data = value;
+
+	return sd_ble_gatts_hvx(p_cfg->conn_handle, &hvx_params);
+}
@@ -0,0 +1,42 @@
+#ifndef BLE_CFG_H__
+#define BLE_CFG_H__
+
+#define BLE_UUID_CFG_SERVICE                0x0001  // config transfer service, 16-bit part of the UUID
+#define BLE_UUID_CFG_DATA_CHARACTERISTIC    0x0002  // chunks and commits, written without response
+#define BLE_UUID_CFG_STATUS_CHARACTERISTIC  0x0003  // acks and CRC results, notified
+
+#define BLE_CFG_MAX_DATA_LEN                244     // value of a 247 byte ATT MTU
+#define BLE_CFG_STATUS_LEN                  4       // op, status, offset (2 bytes, LSB first)
+
+#define BLE_CFG_OP_CHUNK                    0x01    // offset (2 bytes, LSB first), config bytes, any length
+#define BLE_CFG_OP_COMMIT                   0x02    // size (2 bytes), CRC-16/CCITT (2 bytes), LSB first
+
+#define BLE_CFG_STATUS_OK                   0x00    // offset is the next one expected
+#define BLE_CFG_STATUS_RETRY                0x01    // resend from offset
+#define BLE_CFG_STATUS_ERROR                0x02    // bad packet, size or CRC
+
+typedef struct ble_cfg_s ble_cfg_t;
+
+typedef void (*ble_cfg_data_handler_t)(ble_cfg_t *p_cfg, const uint8_t *p_data, uint16_t length);
+
+typedef struct
+{
+	ble_cfg_data_handler_t		data_handler;   // called from the BLE event interrupt for each write
+} ble_cfg_init_t;
+
+struct ble_cfg_s
+{
+	uint8_t						uuid_type;
+	uint16_t					service_handle;
+	ble_gatts_char_handles_t	data_handles;
+	ble_gatts_char_handles_t	status_handles;
+	uint16_t					conn_handle;
+	bool						is_notification_enabled;
+	ble_cfg_data_handler_t		data_handler;
+};
+
+uint32_t ble_cfg_init(ble_cfg_t *p_cfg, const ble_cfg_init_t *p_cfg_init);
+void ble_cfg_on_ble_evt(ble_cfg_t *p_cfg, ble_evt_t *p_ble_evt);
+uint32_t ble_cfg_status_send(ble_cfg_t *p_cfg, uint8_t op, uint8_t status, uint16_t offset);
+
+#endif  /* _ BLE_CFG_H__ */
@@ -294,7 +294,7 @@
 #define UART0_CONFIG_PSEL_RTS 5
 #define UART0_CONFIG_IRQ_PRIORITY APP_IRQ_PRIORITY_LOW
 #ifdef NRF52
-#define UART0_CONFIG_USE_EASY_DMA false
+#define UART0_CONFIG_USE_EASY_DMA true
 //Compile time flag
 #define UART_EASY_DMA_SUPPORT     1
 #define UART_LEGACY_SUPPORT       1
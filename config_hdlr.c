@@ -1,28 +1,482 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include "util.h"
 #include "config_hdlr.h"
 //#include "SEGGER_RTT.h"
 
 static config_hdlr_t config_data[CONFIG_MAX_PARAMS];
+static uint8_t m_key_index[CONFIG_MAX_PARAMS];  // config_data entries sorted by key
 static uint16_t m_param_max;
+static const uint8_t *m_p_block;        // config the entries point into
+static bool m_block_image;              // records of a binary image, else ascii values
 
-static uint16_t getnext_char(char token, uint16_t cur_idx, uint8_t *p_data)
+typedef struct
+{
+    char         	key[CONFIG_KEY_LEN + 1];
+    uint8_t      	kind;           // CONFIG_SCHEMA_xxx
+    uint8_t      	size;           // longest string, bytes, or size of the number
+    uint16_t     	offset;         // member in config_values_t
+    uint32_t     	number;         // default of a number
+    uint32_t     	min;
+    uint32_t     	max;
+    const char   	*p_string;      // default of a string
+} config_field_t;
+
+#define CONFIG_SCHEMA_STR_FIELD(name, key, len, def) \
+	{key, CONFIG_SCHEMA_STR, len, offsetof(config_values_t, name), 0, 0, 0, def},
+#define CONFIG_SCHEMA_HEX_FIELD(name, key, len) \
+	{key, CONFIG_SCHEMA_HEX, len, offsetof(config_values_t, name), 0, 0, 0, NULL},
+#define CONFIG_SCHEMA_NUM_FIELD(name, key, type, def, lo, hi) \
+	{key, CONFIG_SCHEMA_NUM, sizeof(type), offsetof(config_values_t, name), def, lo, hi, NULL},
+
+static const config_field_t m_fields[CONFIG_FIELD_COUNT] = {
+    CONFIG_SCHEMA(CONFIG_SCHEMA_STR_FIELD, CONFIG_SCHEMA_HEX_FIELD, CONFIG_SCHEMA_NUM_FIELD)
+};
+static config_values_t m_values;
+
+// Keys shorter than CONFIG_KEY_LEN are padded with 0, as parsed.
+static uint32_t key_to_word(const char *p_key)
+{
+    uint32_t key = 0;
+    uint8_t i;
+
+    for (i = 0; i < CONFIG_KEY_LEN && p_key[i] != '\0'; i++)
+		((uint8_t *)&key)[i] = (uint8_t)p_key[i];
+    return (key);
+}
+
+// Binary search of the key index, the first entry of the file wins when a key repeats.
+static config_hdlr_t *config_hdlr_find(char *p_key)
+{
+    uint32_t key = key_to_word(p_key);
+    uint16_t lo = 0;
+    uint16_t hi = m_param_max;
+    uint16_t mid;
+
+    while (lo < hi)
+    {
+		mid = (lo + hi) >> 1;
+		if (config_data[m_key_index[mid]].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+    }
+    if (lo < m_param_max && config_data[m_key_index[lo]].key == key)
+		return (&config_data[m_key_index[lo]]);
+    return NULL;
+}
+
+// Insert behind the equal keys, so the index stays in file order for them.
+static void config_hdlr_index_add(uint16_t param_idx)
+{
+    uint16_t pos;
+
+    for (pos = param_idx; pos > 0 &&
+         config_data[m_key_index[pos - 1]].key > config_data[param_idx].key; pos--)
+		m_key_index[pos] = m_key_index[pos - 1];
+    m_key_index[pos] = param_idx;
+}
+
+// Records of a binary config image, NULL if the block holds none.
+static const uint8_t *config_image_records(const uint8_t *p_block, uint16_t size,
+                                           bool check_crc, uint16_t *p_len)
+{
+    const config_image_header_t *p_header = (const config_image_header_t *)p_block;
+
+    if (!config_hdlr_is_image(p_block) ||
+        p_header->len > size - sizeof(config_image_header_t))
+		return NULL;
+    if (check_crc &&
+        crc32_ieee(p_block + sizeof(config_image_header_t), p_header->len, CRC32_INIT) != p_header->crc)
+		return NULL;
+
+    *p_len = p_header->len;
+    return (p_block + sizeof(config_image_header_t));
+}
+
+// Length of the record at p_rec, 0 if it runs past p_end.
+static uint16_t config_record_len(const uint8_t *p_rec, const uint8_t *p_end)
+{
+    if (p_end - p_rec < CONFIG_RECORD_HEADER ||
+        p_end - p_rec < CONFIG_RECORD_HEADER + p_rec[CONFIG_KEY_LEN + 1])
+		return 0;
+    return (CONFIG_RECORD_HEADER + p_rec[CONFIG_KEY_LEN + 1]);
+}
+
+// Value of a record as it was written in the ascii file.
+static uint8_t config_record_value(const uint8_t *p_rec, uint8_t *p_dest)
+{
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *p_value = p_rec + CONFIG_RECORD_HEADER;
+    uint8_t len = p_rec[CONFIG_KEY_LEN + 1];
+    uint32_t number = 0;
+    uint8_t i;
+
+    switch (p_rec[CONFIG_KEY_LEN]) {
+		case CONFIG_RECORD_NUMBER :
+			for (i = 0; i < len; i++)
+				number |= (uint32_t)p_value[i] << (8 * i);
+			return longword_to_ascii(p_dest, number);
+
+		case CONFIG_RECORD_HEX :
+			for (i = 0; i < len; i++)
+			{
+				p_dest[2 * i] = hex[p_value[i] >> 4];
+				p_dest[2 * i + 1] = hex[p_value[i] & 0x0F];
+			}
+			return (2 * len);
+
+		default :
+			memcpy(p_dest, p_value, len);
+			return (len);
+    }
+}
+
+// Type and length of a record are ones config_hdlr_encode writes.
+static bool config_record_valid(const uint8_t *p_rec)
+{
+    uint8_t len = p_rec[CONFIG_KEY_LEN + 1];
+
+    switch (p_rec[CONFIG_KEY_LEN]) {
+		case CONFIG_RECORD_NUMBER :
+			return (len > 0 && len <= sizeof(uint32_t));
+
+		case CONFIG_RECORD_HEX :
+			return (len <= CONFIG_BYTES_LEN);
+
+		case CONFIG_RECORD_TEXT :
+			return (len <= CONFIG_VALUE_LEN);
+
+		default :
+			return false;
+    }
+}
+
+// Value of an entry as written in the ascii file, read where the entry points.
+// p_dest holds CONFIG_VALUE_LEN bytes. A record no longer holding the key, the
+// config block rewritten since it was loaded, reads as empty.
+static uint8_t config_entry_value(const config_hdlr_t *p_entry, uint8_t *p_dest)
+{
+    const uint8_t *p_rec = m_p_block + p_entry->offset;
+
+    if (!m_block_image)
+    {
+		memcpy(p_dest, p_rec, p_entry->len);
+		return (p_entry->len);
+    }
+    if (memcmp(p_rec, &p_entry->key, CONFIG_KEY_LEN) || !config_record_valid(p_rec))
+		return 0;
+    return config_record_value(p_rec, p_dest);
+}
+
+// Line of a record, <key>=<value><0x0A>, p_dest holds CONFIG_LINE_MAX bytes.
+static uint8_t config_record_line(const uint8_t *p_rec, uint8_t *p_dest)
+{
+    uint8_t len = 0;
+
+    while (len < CONFIG_KEY_LEN && p_rec[len] != '\0')
+    {
+		p_dest[len] = p_rec[len];
+		len++;
+    }
+    p_dest[len++] = CONFIG_EQUAL;
+    len += config_record_value(p_rec, p_dest + len);
+    p_dest[len++] = CONFIG_LIMITER;
+    return (len);
+}
+
+// Decimal that fits 32 bits.
+static bool text_to_decimal(const uint8_t *p_text, uint8_t len, uint32_t *p_number)
+{
+    uint32_t number = 0;
+    uint8_t digit;
+    uint8_t i;
+
+    if (len == 0)
+		return false;
+
+    for (i = 0; i < len; i++)
+    {
+		if (p_text[i] < '0' || p_text[i] > '9')
+			return false;
+		digit = p_text[i] - ZERO;
+		if (number > (0xFFFFFFFF - digit) / SCALER)
+			return false;
+		number = number * SCALER + digit;
+    }
+    *p_number = number;
+    return true;
+}
+
+// Decimal without a leading 0 that fits 32 bits, so it reads back the same.
+static bool text_to_number(const uint8_t *p_text, uint8_t len, uint32_t *p_number)
+{
+    if (len > CONFIG_LONGWORD_DIGITS_MAX || (len > 1 && p_text[0] == ZERO))
+		return false;
+    return text_to_decimal(p_text, len, p_number);
+}
+
+// Lower case hex pairs, so they read back the same.
+static bool text_is_hex(const uint8_t *p_text, uint8_t len)
+{
+    uint8_t i;
+
+    if (len == 0 || (len & 1))
+		return false;
+
+    for (i = 0; i < len; i++)
+    {
+		if ((p_text[i] < '0' || p_text[i] > '9') && (p_text[i] < 'a' || p_text[i] > 'f'))
+			return false;
+    }
+    return true;
+}
+
+// Encode one entry as a record at p_out, returns the record length.
+// p_out must hold CONFIG_RECORD_HEADER + value_len bytes, no value gets longer.
+static uint8_t config_record_encode(uint8_t *p_out, const uint8_t *p_key, uint8_t key_len,
+                                    const uint8_t *p_value, uint8_t value_len)
+{
+    uint32_t number;
+    uint8_t i;
+
+    memset(p_out, 0, CONFIG_KEY_LEN);
+    memcpy(p_out, p_key, key_len);
+    if (text_to_number(p_value, value_len, &number))
+    {
+		p_out[CONFIG_KEY_LEN] = CONFIG_RECORD_NUMBER;
+		i = 0;
+		do
+		{
+			p_out[CONFIG_RECORD_HEADER + i++] = (uint8_t)number;
+			number >>= 8;
+		} while (number);
+		p_out[CONFIG_KEY_LEN + 1] = i;
+    }
+    else if (text_is_hex(p_value, value_len))
+    {
+		p_out[CONFIG_KEY_LEN] = CONFIG_RECORD_HEX;
+		p_out[CONFIG_KEY_LEN + 1] = value_len >> 1;
+		for (i = 0; i < value_len; i += 2)
+			p_out[CONFIG_RECORD_HEADER + (i >> 1)] = ascii_to_bcd(p_value[i], p_value[i + 1]);
+    }
+    else
+    {
+		p_out[CONFIG_KEY_LEN] = CONFIG_RECORD_TEXT;
+		p_out[CONFIG_KEY_LEN + 1] = value_len;
+		memcpy(p_out + CONFIG_RECORD_HEADER, p_value, value_len);
+    }
+    return (CONFIG_RECORD_HEADER + p_out[CONFIG_KEY_LEN + 1]);
+}
+
+// Fill in the header in front of the records ending at p_out, returns the image size.
+static uint16_t config_image_close(uint8_t *p_dest, const uint8_t *p_out)
+{
+    config_image_header_t *p_header = (config_image_header_t *)p_dest;
+
+    p_header->magic = CONFIG_IMAGE_MAGIC;
+    p_header->version = CONFIG_IMAGE_VERSION;
+    p_header->reserved = 0;
+    p_header->len = p_out - (p_dest + sizeof(config_image_header_t));
+    p_header->crc = crc32_ieee(p_dest + sizeof(config_image_header_t), p_header->len, CRC32_INIT);
+    return (sizeof(config_image_header_t) + p_header->len);
+}
+
+// Length of the delta at p_delta, record, CRC-16 and padding to a word,
+// 0 at the erased end of the block or on a torn or corrupt delta.
+static uint16_t config_delta_len(const uint8_t *p_delta, const uint8_t *p_end)
+{
+    uint16_t rec_len;
+
+    if (p_end - p_delta < CONFIG_RECORD_HEADER || p_delta[0] == CONFIG_DELTA_ERASED)
+		return 0;
+    rec_len = config_record_len(p_delta, p_end);
+    if (rec_len == 0 || p_end - p_delta < rec_len + CONFIG_DELTA_CRC_LEN ||
+        crc16_ccitt(p_delta, rec_len, CRC16_CCITT_INIT) !=
+        (p_delta[rec_len] | (p_delta[rec_len + 1] << 8)))
+		return 0;
+    return ((rec_len + CONFIG_DELTA_CRC_LEN + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1));
+}
+
+// First delta of a valid image, the deltas follow the records on a word boundary.
+static const uint8_t *config_image_deltas(const uint8_t *p_block, uint16_t image_len)
+{
+    return (p_block + ((sizeof(config_image_header_t) + image_len + sizeof(uint32_t) - 1) &
+                       ~(sizeof(uint32_t) - 1)));
+}
+
+// Record of the key as last patched, or p_rec itself if no delta changed it.
+static const uint8_t *config_record_latest(const uint8_t *p_rec, const uint8_t *p_delta,
+                                           const uint8_t *p_end)
+{
+    const uint8_t *p_latest = p_rec;
+    uint16_t delta_len;
+
+    for (; (delta_len = config_delta_len(p_delta, p_end)) != 0; p_delta += delta_len)
+    {
+		if (!memcmp(p_delta, p_rec, CONFIG_KEY_LEN))
+			p_latest = p_delta;
+    }
+    return (p_latest);
+}
+
+// Schema field of a key, NULL for a key the firmware does not read.
+static const config_field_t *config_field_find(uint32_t key)
+{
+    uint8_t i;
+
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++)
+    {
+		if (key_to_word(m_fields[i].key) == key)
+			return (&m_fields[i]);
+    }
+    return NULL;
+}
+
+// Check a value against its schema field.
+static bool config_field_check(const config_field_t *p_field, const uint8_t *p_value, uint8_t len)
+{
+    uint32_t number;
+    uint8_t i;
+
+    switch (p_field->kind) {
+		case CONFIG_SCHEMA_STR :
+			return (len <= p_field->size);
+
+		case CONFIG_SCHEMA_HEX :
+			if (len != (p_field->size << 1))
+				return false;
+			for (i = 0; i < len; i++)
+			{
+				if ((p_value[i] < '0' || p_value[i] > '9') &&
+				    ((p_value[i] | 0x20) < 'a' || (p_value[i] | 0x20) > 'f'))
+					return false;
+			}
+			return true;
+
+		default :
+			return (text_to_decimal(p_value, len, &number) &&
+			        number >= p_field->min && number <= p_field->max);
+    }
+}
+
+// Check a <key>=<value> line, true for a key the schema does not list.
+static bool config_line_check(const uint8_t *p_key, uint8_t key_len, const uint8_t *p_value, uint8_t len)
+{
+    const config_field_t *p_field;
+    uint32_t key = 0;
+
+    memcpy(&key, p_key, key_len);
+    p_field = config_field_find(key);
+    return (p_field == NULL || config_field_check(p_field, p_value, len));
+}
+
+static void config_number_store(const config_field_t *p_field, uint8_t *p_member, uint32_t number)
+{
+    switch (p_field->size) {
+		case sizeof(uint8_t) :
+			*p_member = (uint8_t)number;
+			break;
+
+		case sizeof(uint16_t) :
+			*(uint16_t *)p_member = (uint16_t)number;
+			break;
+
+		default :
+			*(uint32_t *)p_member = number;
+			break;
+    }
+}
+
+// Fill the member of a schema field from its entry, or with the default if
+// the config has no valid one.
+static void config_field_load(const config_field_t *p_field)
+{
+    uint8_t *p_member = (uint8_t *)&m_values + p_field->offset;
+    uint32_t bit = 1UL << (p_field - m_fields);
+    config_hdlr_t *p_entry;
+    uint8_t value[CONFIG_VALUE_LEN];
+    uint8_t len = 0;
+    uint32_t number;
+    uint8_t i;
+
+    p_entry = config_hdlr_find((char *)p_field->key);
+    if (p_entry != NULL)
+		len = config_entry_value(p_entry, value);
+    if (p_entry == NULL || !config_field_check(p_field, value, len))
+    {
+		m_values.present &= ~bit;
+		switch (p_field->kind) {
+			case CONFIG_SCHEMA_STR :
+				memset(p_member, 0, p_field->size + 1);
+				strcpy((char *)p_member, p_field->p_string);
+				break;
+
+			case CONFIG_SCHEMA_HEX :
+				memset(p_member, 0, p_field->size);
+				break;
+
+			default :
+				config_number_store(p_field, p_member, p_field->number);
+				break;
+		}
+		return;
+    }
+
+    m_values.present |= bit;
+    switch (p_field->kind) {
+		case CONFIG_SCHEMA_STR :
+			memset(p_member, 0, p_field->size + 1);
+			memcpy(p_member, value, len);
+			break;
+
+		case CONFIG_SCHEMA_HEX :
+			for (i = 0; i < p_field->size; i++)
+				p_member[i] = ascii_to_bcd(value[i << 1], value[(i << 1) + 1]);
+			break;
+
+		default :
+			text_to_decimal(value, len, &number);
+			config_number_store(p_field, p_member, number);
+			break;
+    }
+}
+
+static void config_values_load(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++)
+		config_field_load(&m_fields[i]);
+}
+
+// Point the entry a delta patches at the delta, in the loaded block.
+static void config_delta_apply(const uint8_t *p_delta)
+{
+    char key[CONFIG_KEY_LEN + 1];
+    config_hdlr_t *p_entry;
+
+    memset(key, 0, sizeof(key));
+    memcpy(key, p_delta, CONFIG_KEY_LEN);
+    p_entry = config_hdlr_find(key);
+    if (p_entry != NULL)
+		p_entry->offset = p_delta - m_p_block;
+}
+
+// Index of the next token from cur_idx on, idx_stop if there is none before it.
+static uint16_t getnext_char(char token, uint16_t cur_idx, uint16_t idx_stop, uint8_t *p_data)
 {
     uint16_t idx;
-    uint16_t idx_stop = cur_idx + sizeof(config_hdlr_t);
 
     for (idx = cur_idx; idx < idx_stop; idx++)
     {
 		if (*(p_data + idx) == token)
 		   break;
     }
-    if (idx != idx_stop)
-		return (idx);
-    else
-		return 0;
+    return (idx);
 }
 
 void config_hdlr_init(void)
@@ -31,6 +485,9 @@ void config_hdlr_init(void)
     for (i = 0; i < CONFIG_MAX_PARAMS; i++)
 		memset(&config_data[i], 0, sizeof(config_hdlr_t));
     m_param_max = 0;
+    m_p_block = NULL;
+    m_block_image = false;
+    config_values_load();
 }
 
 // Data file must be ascii file with the format
@@ -47,235 +504,306 @@ void config_hdlr_parse(uint16_t len, uint8_t *p_data)
 	//char value[33];
 	
 	//SEGGER_RTT_printf(0, "config hdlr: raw size: %d\n", len);
-    while (toloop && cur_idx < len)
+    m_p_block = p_data;
+    m_block_image = false;
+    while (toloop && cur_idx < len && param_idx < CONFIG_MAX_PARAMS)
     {
 		// Get the next limiter index.
-		limit_idx = getnext_char(CONFIG_LIMITER, cur_idx, p_data);
-		equal_idx = getnext_char(CONFIG_EQUAL, cur_idx, p_data);
-		memcpy(config_data[param_idx].key, p_data + cur_idx, equal_idx - cur_idx);
-		memcpy(config_data[param_idx].value, p_data + equal_idx + 1, limit_idx - equal_idx - 1);
-		config_data[param_idx].len = limit_idx - equal_idx - 1;
+		limit_idx = getnext_char(CONFIG_LIMITER, cur_idx, len, p_data);
+		if (limit_idx == len)
+			break;
+		equal_idx = getnext_char(CONFIG_EQUAL, cur_idx, limit_idx, p_data);
+		// A line the entries cannot hold is skipped, up to its 0x0A.
+		if (equal_idx > cur_idx && equal_idx < limit_idx &&
+		    equal_idx - cur_idx <= CONFIG_KEY_LEN && limit_idx - equal_idx - 1 <= CONFIG_VALUE_LEN)
+		{
+			config_data[param_idx].key = 0;
+			memcpy(&config_data[param_idx].key, p_data + cur_idx, equal_idx - cur_idx);
+			config_data[param_idx].offset = equal_idx + 1;
+			config_data[param_idx].len = limit_idx - equal_idx - 1;
 		
-		// Debug
-		//memcpy(key, config_data[param_idx].key, 4);
-		//key[4] = 0;
-		//memcpy(value, config_data[param_idx].value, 32);
-		//value[config_data[param_idx].len] = 0;
-		//SEGGER_RTT_printf(0, "config hdlr: key: %s content: %s\n", key, value);
+			// Debug
+			//memcpy(key, &config_data[param_idx].key, 4);
+			//key[4] = 0;
+			//memcpy(value, p_data + config_data[param_idx].offset, config_data[param_idx].len);
+			//value[config_data[param_idx].len] = 0;
+			//SEGGER_RTT_printf(0, "config hdlr: key: %s content: %s\n", key, value);
 		
-		param_idx++;
+			config_hdlr_index_add(param_idx);
+			param_idx++;
+		}
 		cur_idx = limit_idx + 1;
     }
     m_param_max = param_idx;
+    config_values_load();
 	//SEGGER_RTT_printf(0, "config hdlr: num of params: %d\n", m_param_max);
 }
 
-// The value string, once found, will be copied into the passed in buffer, with the
-// terminating /0. The length of the string (exclude terminating \0) is set in *p_len. 
-bool config_hdlr_get_bcd(char *p_key, uint16_t *p_len, char *p_dest)
+// Load the config block, a binary image or the ascii file written before it.
+// The CRC of an image is checked, its records need no parsing. The block stays
+// in place, mapped flash, as the entries point into it.
+void config_hdlr_load(const uint8_t *p_block, uint16_t size)
 {
-    uint16_t idx = 0;
-	uint16_t j;
-	
-    while (idx < m_param_max)
+    const uint8_t *p_rec;
+    const uint8_t *p_end;
+    uint16_t len;
+    uint16_t rec_len;
+    uint16_t param_idx = 0;
+
+    config_hdlr_init();
+    p_rec = config_image_records(p_block, size, true, &len);
+    if (p_rec == NULL)
     {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
-		
-		j = 0;
-		for (uint16_t i = 0; i < config_data[idx].len; i = i + 2)
-		{
-			*(p_dest + j) = ascii_to_bcd(config_data[idx].value[i], config_data[idx].value[i+1]);
-			j++;			
-		}
-		//memcpy(p_dest, config_data[idx].value, config_data[idx].len);
-		//*(p_dest + config_data[idx].len) = '\0';
-		*p_len = config_data[idx].len >> 1;
-		return true;
+		if (config_hdlr_is_image(p_block))
+			return;
+		// The ascii file is terminated by 0x00.
+		for (len = 0; len < size && p_block[len] != 0x00; len++)
+			;
+		if (len < size)
+			config_hdlr_parse(len, (uint8_t *)p_block);
+		return;
     }
-    return false;
-}
 
-// The value string, once found, will be copied into the passed in buffer, with the
-// terminating /0. The length of the string (exclude terminating \0) is set in *p_len. 
-bool config_hdlr_get_string(char *p_key, uint16_t *p_len, char *p_dest)
-{
-    uint16_t idx = 0;
-    while (idx < m_param_max)
+    m_p_block = p_block;
+    m_block_image = true;
+    p_end = p_rec + len;
+    while (param_idx < CONFIG_MAX_PARAMS && (rec_len = config_record_len(p_rec, p_end)) != 0)
     {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
-		memcpy(p_dest, config_data[idx].value, config_data[idx].len);
-		//*(p_dest + config_data[idx].len) = '\0';
-		*p_len = config_data[idx].len;
-		//SEGGER_RTT_printf(0, "config hdlr: found idx: %d len: %d\n", idx, config_data[idx].len);
-		return true;
+		memcpy(&config_data[param_idx].key, p_rec, CONFIG_KEY_LEN);
+		config_data[param_idx].offset = p_rec - p_block;
+		config_hdlr_index_add(param_idx);
+		param_idx++;
+		p_rec += rec_len;
     }
-    return false;
+    m_param_max = param_idx;
+
+    // Patches written since, in order.
+    p_rec = config_image_deltas(p_block, len);
+    for (p_end = p_block + size; (rec_len = config_delta_len(p_rec, p_end)) != 0; p_rec += rec_len)
+		config_delta_apply(p_rec);
+    config_values_load();
 }
 
-bool config_hdlr_get_byte(char *p_key, uint8_t *p_dest)
+// Convert an ascii config file, <key>=<value><0x0A>..., into a binary image.
+// Numbers and hex strings are stored as binary, other values as text.
+// Returns the size of the image, 0 if the file does not fit, has a bad line
+// or a value the schema does not allow.
+uint16_t config_hdlr_encode(const uint8_t *p_text, uint16_t len, uint8_t *p_dest, uint16_t size)
 {
-    uint16_t idx = 0;
-    while (idx < m_param_max)
+    uint8_t *p_out = p_dest + sizeof(config_image_header_t);
+    uint16_t cur_idx = 0;
+    uint16_t limit_idx;
+    uint16_t equal_idx;
+    uint16_t count = 0;
+    uint8_t value_len;
+
+    if (size < sizeof(config_image_header_t))
+		return 0;
+
+    while (cur_idx < len)
     {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
+		for (limit_idx = cur_idx; limit_idx < len && p_text[limit_idx] != CONFIG_LIMITER; limit_idx++)
+			;
+		if (limit_idx == cur_idx)
 		{
-			idx++;
+			cur_idx++;
 			continue;
 		}
+		for (equal_idx = cur_idx; equal_idx < limit_idx && p_text[equal_idx] != CONFIG_EQUAL; equal_idx++)
+			;
+		if (equal_idx == cur_idx || equal_idx == limit_idx ||
+		    equal_idx - cur_idx > CONFIG_KEY_LEN ||
+		    limit_idx - equal_idx - 1 > CONFIG_VALUE_LEN ||
+		    ++count > CONFIG_MAX_PARAMS)
+			return 0;
 
-		if (config_data[idx].len > CONFIG_BYTE_DIGITS_MAX)	
-			return false;
+		value_len = limit_idx - equal_idx - 1;
+		if (p_out + CONFIG_RECORD_HEADER + value_len > p_dest + size ||
+		    !config_line_check(p_text + cur_idx, equal_idx - cur_idx, p_text + equal_idx + 1, value_len))
+			return 0;
 
-		*p_dest = ascii_to_byte(config_data[idx].value, config_data[idx].len);
-		return true;
+		p_out += config_record_encode(p_out, p_text + cur_idx, equal_idx - cur_idx,
+		                              p_text + equal_idx + 1, value_len);
+		cur_idx = limit_idx + 1;
     }
-    return false;
+    return config_image_close(p_dest, p_out);
 }
 
-bool config_hdlr_get_word(char *p_key, uint16_t *p_dest)
+// Encode the entries as they are now, patches included, into a binary image,
+// with the entry p_delta patches taking its value. Records are copied as they
+// are. Returns the size of the image, 0 if it does not fit or a record no longer
+// holds its entry.
+uint16_t config_hdlr_image_build(uint8_t *p_dest, uint16_t size, const uint8_t *p_delta)
 {
-    uint16_t idx = 0;
-    while (idx < m_param_max)
-    {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
-		
-		if (config_data[idx].len > CONFIG_WORD_DIGITS_MAX)	
-			return false;
+    uint8_t *p_out = p_dest + sizeof(config_image_header_t);
+    const config_hdlr_t *p_patched = NULL;
+    const uint8_t *p_rec;
+    char key[CONFIG_KEY_LEN + 1];
+    uint16_t rec_len;
+    uint16_t idx;
+    uint8_t key_len;
 
-		*p_dest = ascii_to_word(config_data[idx].value, config_data[idx].len);
-		return true;
+    if (p_delta != NULL)
+    {
+		memset(key, 0, sizeof(key));
+		memcpy(key, p_delta, CONFIG_KEY_LEN);
+		p_patched = config_hdlr_find(key);
     }
-    return false;
-}
 
-bool config_hdlr_get_longword(char *p_key, uint32_t *p_dest)
-{
-    uint16_t idx = 0;
-    while (idx < m_param_max)
+    for (idx = 0; idx < m_param_max; idx++)
     {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
+		p_rec = NULL;
+		if (&config_data[idx] == p_patched)
+			p_rec = p_delta;
+		else if (m_block_image)
 		{
-			idx++;
+			p_rec = m_p_block + config_data[idx].offset;
+			// The block was rewritten since it was loaded.
+			if (memcmp(p_rec, &config_data[idx].key, CONFIG_KEY_LEN) || !config_record_valid(p_rec))
+				return 0;
+		}
+
+		if (p_rec != NULL)
+		{
+			rec_len = CONFIG_RECORD_HEADER + p_rec[CONFIG_KEY_LEN + 1];
+			if (p_out + rec_len > p_dest + size)
+				return 0;
+			memcpy(p_out, p_rec, rec_len);
+			p_out += rec_len;
 			continue;
 		}
-		
-		if (config_data[idx].len > CONFIG_LONGWORD_DIGITS_MAX)	
-			return false;
 
-		*p_dest = ascii_to_longword(config_data[idx].value, config_data[idx].len);
-		return true;
+		if (p_out + CONFIG_RECORD_HEADER + config_data[idx].len > p_dest + size)
+			return 0;
+		for (key_len = 0; key_len < CONFIG_KEY_LEN &&
+		     ((uint8_t *)&config_data[idx].key)[key_len] != '\0'; key_len++)
+			;
+		p_out += config_record_encode(p_out, (uint8_t *)&config_data[idx].key, key_len,
+		                              m_p_block + config_data[idx].offset, config_data[idx].len);
     }
-    return false;
+    return config_image_close(p_dest, p_out);
 }
 
-uint16_t config_hdlr_build(uint8_t *p_dest)
+// Encode a <key>=<value> patch of an existing entry as a delta: the record,
+// its CRC-16 and 0xFF up to a word. Returns the delta size, 0 if the key is
+// unknown or the value too long or not allowed by the schema.
+uint16_t config_hdlr_delta_encode(const uint8_t *p_line, uint16_t len, uint8_t *p_dest)
 {
-    uint16_t idx;
-    uint16_t rc = 0;
-    for (idx = 0; idx < m_param_max; idx++)
-    {
-		memcpy(p_dest, config_data[idx].key, CONFIG_KEY_LEN);
-		p_dest += CONFIG_KEY_LEN;
-		*p_dest = CONFIG_EQUAL;
-		p_dest++;
-		memcpy(p_dest, config_data[idx].value, config_data[idx].len);
-		p_dest += config_data[idx].len;
-		*p_dest = CONFIG_LIMITER;
-		p_dest++;
-		rc += (CONFIG_KEY_LEN + config_data[idx].len + 2);
-    }
-    return (rc);
+    char key[CONFIG_KEY_LEN + 1];
+    uint16_t equal_idx;
+    uint16_t rec_len;
+    uint16_t crc;
+    uint16_t delta_len;
+
+    for (equal_idx = 0; equal_idx < len && p_line[equal_idx] != CONFIG_EQUAL; equal_idx++)
+		;
+    if (equal_idx == 0 || equal_idx == len || equal_idx > CONFIG_KEY_LEN ||
+        len - equal_idx - 1 > CONFIG_VALUE_LEN)
+		return 0;
+
+    memset(key, 0, sizeof(key));
+    memcpy(key, p_line, equal_idx);
+    if (config_hdlr_find(key) == NULL ||
+        !config_line_check(p_line, equal_idx, p_line + equal_idx + 1, len - equal_idx - 1))
+		return 0;
+
+    rec_len = config_record_encode(p_dest, p_line, equal_idx, p_line + equal_idx + 1, len - equal_idx - 1);
+    crc = crc16_ccitt(p_dest, rec_len, CRC16_CCITT_INIT);
+    p_dest[rec_len] = (uint8_t)crc;
+    p_dest[rec_len + 1] = (uint8_t)(crc >> 8);
+    delta_len = (rec_len + CONFIG_DELTA_CRC_LEN + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    memset(p_dest + rec_len + CONFIG_DELTA_CRC_LEN, CONFIG_DELTA_ERASED,
+           delta_len - rec_len - CONFIG_DELTA_CRC_LEN);
+    return (delta_len);
 }
 
-// The value string, once found, will be copied into the passed in buffer, with the
-// terminating /0. The length of the string (exclude terminating \0) is set in *p_len. 
-bool config_hdlr_set_string(char *p_key, uint16_t len, char *p_src)
+const config_values_t *config_hdlr_values(void)
 {
-    uint16_t idx = 0;
+    return (&m_values);
+}
 
-    if (len > CONFIG_VALUE_LEN)
-		return false;
+// Bytes of the block taken by a valid image and its deltas, 0 if the block
+// holds no image, so the next patch needs a new one.
+uint16_t config_hdlr_block_used(const uint8_t *p_block, uint16_t size)
+{
+    const uint8_t *p_delta;
+    const uint8_t *p_end = p_block + size;
+    uint16_t len;
+    uint16_t delta_len;
 
-    while (idx < m_param_max)
-    {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
+    if (config_image_records(p_block, size, true, &len) == NULL)
+		return 0;
 
-		memset(config_data[idx].value, 0, CONFIG_VALUE_LEN);	
-		memcpy(config_data[idx].value, p_src, len);
-		config_data[idx].len = len;
-		return true;
-    }
-    return false;
+    p_delta = config_image_deltas(p_block, len);
+    if (p_delta > p_end)
+		return size;
+    for (; (delta_len = config_delta_len(p_delta, p_end)) != 0; p_delta += delta_len)
+		;
+    // A delta torn by a reset is not erased, only a new image gets past it.
+    if (p_delta < p_end && p_delta[0] != CONFIG_DELTA_ERASED)
+		return size;
+    return (p_delta - p_block);
 }
-bool config_hdlr_set_byte(char *p_key, uint8_t value)
+
+bool config_hdlr_is_image(const uint8_t *p_block)
 {
-    uint16_t idx = 0;
-    while (idx < m_param_max)
-    {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
+    const config_image_header_t *p_header = (const config_image_header_t *)p_block;
 
-		memset(config_data[idx].value, 0, CONFIG_VALUE_LEN);
-		config_data[idx].len = byte_to_ascii(config_data[idx].value, value);
-		//SEGGER_RTT_printf(0, "config hdlr: set byte: %d %s\n", idx, config_data[idx].value);		
-		return true;
-    }
-    return false;
+    return (p_header->magic == CONFIG_IMAGE_MAGIC && p_header->version == CONFIG_IMAGE_VERSION);
 }
 
-bool config_hdlr_set_word(char *p_key, uint16_t value)
+// Size of the ascii file a binary image reads back as, patches included,
+// 0 if the image is not valid.
+uint16_t config_hdlr_text_size(const uint8_t *p_block, uint16_t size)
 {
-    uint16_t idx = 0;
-    while (idx < m_param_max)
-    {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
-		{
-			idx++;
-			continue;
-		}
+    uint8_t line[CONFIG_LINE_MAX];
+    const uint8_t *p_rec;
+    const uint8_t *p_delta;
+    const uint8_t *p_end;
+    uint16_t len;
+    uint16_t rec_len;
+    uint16_t rc = 0;
 
-		memset(config_data[idx].value, 0, CONFIG_VALUE_LEN);
-		config_data[idx].len = word_to_ascii(config_data[idx].value, value);
-		//SEGGER_RTT_printf(0, "config hdlr: set word: %d %s\n", idx, config_data[idx].value);		
-		return true;
-    }
-    return false;
+    p_rec = config_image_records(p_block, size, true, &len);
+    if (p_rec == NULL)
+		return 0;
+
+    p_delta = config_image_deltas(p_block, len);
+    for (p_end = p_rec + len; (rec_len = config_record_len(p_rec, p_end)) != 0; p_rec += rec_len)
+		rc += config_record_line(config_record_latest(p_rec, p_delta, p_block + size), line);
+    return (rc);
 }
 
-bool config_hdlr_set_longword(char *p_key, uint32_t value)
+// Part of the ascii file a binary image reads back as, the lines are rebuilt
+// from the records as they go by. Returns the number of bytes copied.
+uint16_t config_hdlr_text_read(const uint8_t *p_block, uint16_t size, uint16_t offset,
+                               uint8_t *p_dest, uint16_t len)
 {
-    uint16_t idx = 0;
-    while (idx < m_param_max)
+    uint8_t line[CONFIG_LINE_MAX];
+    const uint8_t *p_rec;
+    const uint8_t *p_delta;
+    const uint8_t *p_end;
+    uint16_t image_len;
+    uint16_t rec_len;
+    uint16_t line_pos = 0;
+    uint16_t rc = 0;
+    uint8_t line_len;
+    uint8_t i;
+
+    p_rec = config_image_records(p_block, size, false, &image_len);
+    if (p_rec == NULL)
+		return 0;
+
+    p_delta = config_image_deltas(p_block, image_len);
+    for (p_end = p_rec + image_len; rc < len && (rec_len = config_record_len(p_rec, p_end)) != 0; p_rec += rec_len)
     {
-		if (memcmp(config_data[idx].key, p_key, CONFIG_KEY_LEN) != 0)
+		line_len = config_record_line(config_record_latest(p_rec, p_delta, p_block + size), line);
+		for (i = 0; i < line_len && rc < len; i++)
 		{
-			idx++;
-			continue;
+			if (line_pos + i >= offset)
+				p_dest[rc++] = line[i];
 		}
-
-		memset(config_data[idx].value, 0, CONFIG_VALUE_LEN);
-		config_data[idx].len = longword_to_ascii(config_data[idx].value, value);
-		//SEGGER_RTT_printf(0, "config hdlr: set long: %d %s\n", idx, config_data[idx].value);
-		return true;
+		line_pos += line_len;
     }
-    return false;
+    return (rc);
 }
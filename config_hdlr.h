@@ -5,29 +5,82 @@
 #define CONFIG_KEY_LEN          4 
 #define CONFIG_SIZE_LEN         4 
 #define CONFIG_VALUE_LEN        32 
+#define CONFIG_BYTES_LEN        (CONFIG_VALUE_LEN / 2)
 #define CONFIG_LIMITER          0x0A
 #define CONFIG_EQUAL            '='
+#define CONFIG_LINE_MAX         (CONFIG_KEY_LEN + CONFIG_VALUE_LEN + 2)
+
+// Binary config image: header, then one record per entry.
+#define CONFIG_IMAGE_MAGIC      0x47464342      // "BCFG"
+#define CONFIG_IMAGE_VERSION    1
+#define CONFIG_RECORD_HEADER    (CONFIG_KEY_LEN + 2)  // key, record type, value length
+#define CONFIG_RECORD_TEXT      0       // value as written
+#define CONFIG_RECORD_NUMBER    1       // decimal without leading 0, 1 to 4 bytes LSB first
+#define CONFIG_RECORD_HEX       2       // lower case hex pairs, one byte each
+#define CONFIG_DELTA_CRC_LEN    2       // CRC-16/CCITT behind a patch record, LSB first
+#define CONFIG_DELTA_ERASED     0xFF    // first key byte of the free space behind the patches
+#define CONFIG_DELTA_MAX        ((CONFIG_RECORD_HEADER + CONFIG_VALUE_LEN + CONFIG_DELTA_CRC_LEN + 3) & ~3)
  
 
+#include "config_schema.h"
+
+// Kind of a schema field.
+#define CONFIG_SCHEMA_STR       0
+#define CONFIG_SCHEMA_HEX       1
+#define CONFIG_SCHEMA_NUM       2
+
+#define CONFIG_SCHEMA_ID(name, ...)                             CONFIG_FIELD_##name,
+#define CONFIG_SCHEMA_STR_MEMBER(name, key, len, def)           char name[(len) + 1];
+#define CONFIG_SCHEMA_HEX_MEMBER(name, key, len)                uint8_t name[len];
+#define CONFIG_SCHEMA_NUM_MEMBER(name, key, type, def, lo, hi)  type name;
+
+enum
+{
+    CONFIG_SCHEMA(CONFIG_SCHEMA_ID, CONFIG_SCHEMA_ID, CONFIG_SCHEMA_ID)
+    CONFIG_FIELD_COUNT
+};
+
+// Typed values of the schema fields, the default where the config has none.
 typedef struct
 {
-    uint8_t     	key[CONFIG_KEY_LEN];
-    uint32_t     	len;
-    uint8_t      	value[CONFIG_VALUE_LEN];
+    uint32_t     	present;        // bit CONFIG_FIELD_<name> set if the value came from the config
+    CONFIG_SCHEMA(CONFIG_SCHEMA_STR_MEMBER, CONFIG_SCHEMA_HEX_MEMBER, CONFIG_SCHEMA_NUM_MEMBER)
+} config_values_t;
+
+// Value of a schema field, e.g. CONFIG_GET(beacon_frame).
+#define CONFIG_GET(name)        (config_hdlr_values()->name)
+#define CONFIG_HAS(name)        ((config_hdlr_values()->present & (1UL << CONFIG_FIELD_##name)) != 0)
+
+// An entry points at its value in the loaded config, nothing is copied.
+typedef struct
+{
+    uint32_t     	key;            // CONFIG_KEY_LEN characters, compared as one word
+    uint16_t     	offset;         // in the config, of the record or of the ascii value
+    uint8_t      	len;            // characters of an ascii value, records hold their own
 } config_hdlr_t;
 
+typedef struct
+{
+    uint32_t     	magic;          // CONFIG_IMAGE_MAGIC
+    uint8_t      	version;        // CONFIG_IMAGE_VERSION
+    uint8_t      	reserved;
+    uint16_t     	len;            // bytes of records behind the header
+    uint32_t     	crc;            // CRC-32 of the records
+} config_image_header_t;
+
 void config_hdlr_init(void);
 
-// Parse the ascii config file supplied by the calling routine.
+// Parse the ascii config file supplied by the calling routine, which keeps
+// it in place: the entries point into it.
 void config_hdlr_parse(uint16_t len, uint8_t *p_data);
-bool config_hdlr_get_bcd(char *p_key, uint16_t *p_len, char *p_dest);
-bool config_hdlr_get_string(char *p_key, uint16_t *p_len, char *p_dest);
-bool config_hdlr_get_byte(char *p_key, uint8_t *p_dest);
-bool config_hdlr_get_word(char *p_key, uint16_t *p_dest);
-bool config_hdlr_get_longword(char *p_key, uint32_t *p_dest);
-uint16_t config_hdlr_build(uint8_t *p_dest);
-bool config_hdlr_set_string(char *p_key, uint16_t len, char *p_src);
-bool config_hdlr_set_byte(char *p_key, uint8_t value);
-bool config_hdlr_set_word(char *p_key, uint16_t value);
-bool config_hdlr_set_longword(char *p_key, uint32_t value);
+void config_hdlr_load(const uint8_t *p_block, uint16_t size);
+uint16_t config_hdlr_encode(const uint8_t *p_text, uint16_t len, uint8_t *p_dest, uint16_t size);
+uint16_t config_hdlr_image_build(uint8_t *p_dest, uint16_t size, const uint8_t *p_delta);
+uint16_t config_hdlr_delta_encode(const uint8_t *p_line, uint16_t len, uint8_t *p_dest);
+uint16_t config_hdlr_block_used(const uint8_t *p_block, uint16_t size);
+bool config_hdlr_is_image(const uint8_t *p_block);
+const config_values_t *config_hdlr_values(void);
+uint16_t config_hdlr_text_size(const uint8_t *p_block, uint16_t size);
+uint16_t config_hdlr_text_read(const uint8_t *p_block, uint16_t size, uint16_t offset,
+                               uint8_t *p_dest, uint16_t len);
 #endif  /* _ CONFIG_HDLR_H__ */
@@ -0,0 +1,18 @@
+#ifndef CONFIG_SCHEMA_H__
+#define CONFIG_SCHEMA_H__
+
+// Config entries the firmware reads. Each one gets a CONFIG_FIELD_<name>
+// index and a member of config_values_t, checked and filled when the config
+// is stored or loaded. Entries of other keys are kept as they are.
+//
+//   STR(name, key, longest value, default)
+//   HEX(name, key, bytes)                          hex pairs, default all 0
+//   NUM(name, key, C type, default, min, max)      decimal
+#define CONFIG_SCHEMA(STR, HEX, NUM) \
+	STR(version,           "vers", CONFIG_VALUE_LEN, "") \
+	HEX(beacon_uuid,       "be02", 16)                              /* APP_AES_LENGTH */ \
+	HEX(aes_key,           "be05", 16)                              /* APP_AES_LENGTH */ \
+	NUM(fast_adv_interval, "be06", uint32_t, 80, 0x0020, 0x4000)    /* 0.625 ms units */ \
+	NUM(beacon_frame,      "be08", uint8_t, 0, 0, 1)                /* SSCAN_FRAME_xxx */
+
+#endif  /* _ CONFIG_SCHEMA_H__ */
@@ -31,7 +31,7 @@
 #include "nordic_common.h"
 #include "nrf.h"
 #include "app_error.h"
-#include "app_uart.h"
+#include "nrf_drv_uart.h"
 #include "ble.h"
 #include "ble_hci.h"
 #include "ble_srv_common.h"
@@ -42,6 +42,8 @@
 #include "boards.h"
 #include "softdevice_handler.h"
 #include "app_timer.h"
+#include "app_scheduler.h"
+#include "app_util_platform.h"
 #include "device_manager.h"
 #include "pstorage.h"
 #include "app_trace.h"
@@ -56,19 +58,23 @@
 #include "SEGGER_RTT.h"
 
 #include "atcmd.h"
+#include "binproto.h"
+#include "atresp.h"
 #include "radio_notify.h"
 #include "secure_scan.h"
 #include "pstore.h"
 #include "config_hdlr.h"
 #include "uart_reply.h"
+#include "nus_reply.h"
+#include "ble_cfg.h"
+#include "util.h"
 
-#define UART_TX_BUF_SIZE        256                             /**< UART TX buffer size. */
-#define UART_RX_BUF_SIZE        256                             /**< UART RX buffer size. */
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT  1                                          /**< Include or not the service_changed characteristic. if not enabled, the server's database cannot be changed for the lifetime of the device*/
 
 #define CENTRAL_LINK_COUNT               0                                          /**< Number of central links used by the application. When changing this number remember to adjust the RAM settings*/
 #define PERIPHERAL_LINK_COUNT            1                                          /**< Number of peripheral links used by the application. When changing this number remember to adjust the RAM settings*/
+#define APP_ATT_MTU                      247                                        /**< Largest ATT MTU offered to the central on S132. When changing this number remember to adjust the RAM settings*/
 
 #define DEVICE_NAME                      "S-Beacon"                                 /**< Name of device. Will be included in the advertising data. */
 #define NUS_SERVICE_UUID_TYPE           BLE_UUID_TYPE_VENDOR_BEGIN                  /**< UUID type for the Nordic UART Service (vendor specific). */
@@ -77,14 +83,21 @@
 #define APP_ADV_INTERVAL                 300                                        /**< The advertising interval (in units of 0.625 ms. This value corresponds to 100 ms). */
 #define APP_ADV_TIMEOUT_IN_SECONDS       0                                        /**< The advertising timeout in units of seconds. */
 #define APP_ADV_NUS_TIMEOUT_IN_SECONDS   60                                        /**< The advertising timeout in units of seconds. */
+#define APP_ADV_NUS_SHORT_TIMEOUT_IN_SECONDS 3                                     /**< NUS window of a provisioned tag after a power-on or brown-out, in units of seconds. */
 
 #define APP_TIMER_PRESCALER              0                                          /**< Value of the RTC1 PRESCALER register. */
 #define APP_TIMER_OP_QUEUE_SIZE          4                                          /**< Size of timer operation queues. */
 
-#define MIN_CONN_INTERVAL                MSEC_TO_UNITS(100, UNIT_1_25_MS)           /**< Minimum acceptable connection interval (0.1 seconds). */
-#define MAX_CONN_INTERVAL                MSEC_TO_UNITS(200, UNIT_1_25_MS)           /**< Maximum acceptable connection interval (0.2 second). */
-#define SLAVE_LATENCY                    0                                          /**< Slave latency. */
-#define CONN_SUP_TIMEOUT                 MSEC_TO_UNITS(4000, UNIT_10_MS)            /**< Connection supervisory timeout (4 seconds). */
+#define MIN_CONN_INTERVAL                MSEC_TO_UNITS(250, UNIT_1_25_MS)           /**< Minimum acceptable connection interval of an idle connection (0.25 seconds). */
+#define MAX_CONN_INTERVAL                MSEC_TO_UNITS(500, UNIT_1_25_MS)           /**< Maximum acceptable connection interval of an idle connection (0.5 second). */
+#define SLAVE_LATENCY                    3                                          /**< Slave latency of an idle connection, at most 2 seconds between connection events. */
+#define CONN_SUP_TIMEOUT                 MSEC_TO_UNITS(6000, UNIT_10_MS)            /**< Connection supervisory timeout (6 seconds). */
+#define FAST_MIN_CONN_INTERVAL           MSEC_TO_UNITS(7.5, UNIT_1_25_MS)           /**< Minimum acceptable connection interval during a transfer (7.5 ms). */
+#define FAST_MAX_CONN_INTERVAL           MSEC_TO_UNITS(15, UNIT_1_25_MS)            /**< Maximum acceptable connection interval during a transfer (15 ms). */
+#define FAST_SLAVE_LATENCY               0                                          /**< Slave latency during a transfer. */
+#define CONN_IDLE_TIMEOUT                APP_TIMER_TICKS(2000, APP_TIMER_PRESCALER) /**< Time without NUS or config traffic before the connection goes back to the idle parameters. */
+#define CONN_PROFILE_IDLE                0                                          /**< Long interval with slave latency, for an idle connection. */
+#define CONN_PROFILE_FAST                1                                          /**< Shortest interval, while commands or config are transferred. */
 
 #define FIRST_CONN_PARAMS_UPDATE_DELAY   APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER) /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
 #define NEXT_CONN_PARAMS_UPDATE_DELAY    APP_TIMER_TICKS(30000, APP_TIMER_PRESCALER)/**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
@@ -115,11 +128,40 @@
 										
 #define DEAD_BEEF                        0xDEADBEEF                                 /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
 
+#define BOOT_DEFER_TIMEOUT               APP_TIMER_TICKS(1000, APP_TIMER_PRESCALER) /**< Latest time after reset at which the deferred services are brought up, even without a radio notification. */
+
+#define BOOT_TS_TIMERS                   0                                          /**< Boot phase: timer module running. */
+#define BOOT_TS_STACK                    1                                          /**< Boot phase: SoftDevice enabled. */
+#define BOOT_TS_CONFIG                   2                                          /**< Boot phase: config and counter loaded from flash. */
+#define BOOT_TS_ADV_START                3                                          /**< Boot phase: advertising started. */
+#define BOOT_TS_FIRST_ADV                4                                          /**< Boot phase: first advertising event done on air. */
+#define BOOT_TS_SERVICES                 5                                          /**< Boot phase: device manager, NUS and UART up. */
+#define BOOT_TS_MAX                      6
+#define SCHED_MAX_EVENT_DATA_SIZE        0                                          /**< Scheduler events carry no data. */
+#define SCHED_QUEUE_SIZE                 4                                          /**< Scheduler events waiting for the main loop. */
+#define CFG_STREAM_CHUNK                 UART_REPLY_TX_BUF_LEN                      /**< Largest part of the config read from flash at once. */
+#define UART_DEFAULT_BAUDRATE            NRF_UART_BAUDRATE_57600                    /**< UART rate after reset and after a failed at$baud. */
+#define UART_BAUD_CONFIRM_TIMEOUT        APP_TIMER_TICKS(3000, APP_TIMER_PRESCALER) /**< Time the host has to send a command at the rate set by at$baud before the UART falls back. */
+#define BOOT_TS_REPLY_LEN                (BOOT_TS_MAX * (CONFIG_LONGWORD_DIGITS_MAX + 1))
+#define CFG_RX_PACKETS                   4                                          /**< Config service packets waiting for flash, power of 2. */
+#define CFG_CHUNK_HEADER_LEN             3                                          /**< Opcode and offset in front of the chunk data. */
+#define CFG_COMMIT_LEN                   5                                          /**< Opcode, size and CRC. */
+
 static dm_application_instance_t         m_app_handle;                              /**< Application identifier allocated by device manager */
 
 static ble_nus_t                        m_nus;                                      /**< Structure to identify the Nordic UART Service. */
+static ble_cfg_t                        m_cfg;                                      /**< Config transfer service. */
 static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;    /**< Handle of the current connection. */
 
+static ble_gap_conn_params_t            m_conn_profiles[] =                         /**< Connection parameters of each CONN_PROFILE_xxx. */
+{
+    {MIN_CONN_INTERVAL, MAX_CONN_INTERVAL, SLAVE_LATENCY, CONN_SUP_TIMEOUT},
+    {FAST_MIN_CONN_INTERVAL, FAST_MAX_CONN_INTERVAL, FAST_SLAVE_LATENCY, CONN_SUP_TIMEOUT}
+};
+static uint8_t                          m_conn_profile = CONN_PROFILE_IDLE;         /**< CONN_PROFILE_xxx asked for. */
+static volatile uint8_t                 m_conn_idle = 0;                            /**< Set by the idle timer or on disconnect, handled from the main loop. */
+APP_TIMER_DEF(m_conn_idle_timer_id);
+
 static ble_uuid_t                       m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}};  /**< Universally unique service identifier. */
 
 static uint8_t m_beacon_info[APP_BEACON_INFO_LENGTH] =                    /**< Information advertised by the Beacon. */
@@ -144,12 +186,73 @@ static uint8_t m_beacon_uuid[APP_AES_LENGTH] =
 {
 	0
 };
+
+static uint8_t m_beacon_auth_info[SSCAN_AUTH_FRAME_LENGTH];                        /**< Authenticated frame: encrypted UUID, counter and MIC. */
+
+static sscan_ctr_ctx_t m_beacon_ctr;                                                /**< CTR context for m_aes128_key. */
+static sscan_cmac_ctx_t m_beacon_cmac;                                              /**< CMAC subkeys for m_aes128_key. */
+static uint8_t m_beacon_frame = SSCAN_FRAME_PLAIN;                                  /**< Beacon frame format (config be08). */
 static uint8_t m_adv_reinit = 0;
 static uint32_t m_counter_ticks;
+static volatile uint8_t m_counter_reserve = 0;                                      /**< Set from radio notification when the next counter block must be reserved in flash. */
+static volatile uint32_t m_counter_next;                                            /**< First counter value not covered by a reservation queued in flash. */
 static uint32_t m_fast_adv_interval;
-static char m_atcmd_resp_str[PSTORE_MAX_BLOCK + 1];
-static uint8_t m_ble_data_src[APP_ATCMD_MAX_DATA_LEN] = {0};
+static atresp_t m_atresp;                                                   /**< Reply of the command being executed. */
+static const char m_newline_str[] = "\n";
+static const char m_nul_str[] = "NUL";
+static uint32_t m_boot_ts[BOOT_TS_MAX];                                             /**< RTC1 ticks at the end of each boot phase. */
+static bool m_erase_bonds;
+static bool m_services_ready = false;
+static uint16_t m_nus_window = 0;                                                   /**< NUS config window of a provisioned tag, opened once the deferred services are up, in seconds. */
+static volatile uint8_t m_services_pending = 0;                                     /**< Set once the first advertisement is on air, deferred services are started from the main loop. */
+APP_TIMER_DEF(m_boot_timer_id);
+static atcmd_stream_t m_uart_stream;                                        /**< AT command line being received over UART. */
+static atcmd_stream_t m_nus_stream;                                         /**< AT command line being received over NUS. */
+static bool m_uart_binary = false;                                          /**< UART carries COBS frames instead of AT text. */
+static bool m_nus_binary = false;                                           /**< NUS carries COBS frames instead of AT text. */
+static binproto_rx_t m_uart_bin;                                            /**< COBS frame being received over UART. */
+static binproto_rx_t m_nus_bin;                                             /**< COBS frame being received over NUS. */
+static uint8_t m_bin_tlv[BINPROTO_MAX_FRAME];                               /**< TLV payload of a binary reply. */
+static uint8_t m_bin_frame[BINPROTO_MAX_ENCODED];                           /**< Encoded binary reply. */
+static volatile uint8_t m_atcmd_dropped[APP_ATCMD_SRC_COUNT];               /**< Commands dropped on a full queue, per interface. */
+static uint8_t m_atcmd_nacked[APP_ATCMD_SRC_COUNT];                         /**< Dropped commands answered by the main loop. */
+APP_TIMER_DEF(m_baud_timer_id);
+static uint32_t m_baud_pending = 0;                                         /**< NRF_UART_BAUDRATE_xxx to switch to once the reply is out, 0 if none. */
+static bool m_flow_pending = false;                                         /**< RTS/CTS setting to switch to with m_baud_pending. */
+static bool m_baud_unconfirmed = false;                                     /**< No command received yet at the rate set by at$baud. */
+static volatile uint8_t m_baud_revert = 0;                                  /**< Set by the baud timer when the host did not follow. */
+static volatile bool m_cfg_streaming = false;                               /**< at$cfgget? is sending the config, queued commands wait. */
+static uint8_t m_cfg_stream_source;                                         /**< APP_ATCMD_SRC_xxx the config goes to. */
+static uint16_t m_cfg_stream_offset;                                        /**< Next config byte to send. */
+static uint16_t m_cfg_stream_size;                                          /**< Size of the config being sent. */
+static bool m_config_reload = false;                                        /**< Config block rewritten, its entries are loaded again once flash is idle. */
+static uint8_t m_cfg_rx_buf[CFG_RX_PACKETS][BLE_CFG_MAX_DATA_LEN];          /**< Config service packets, filled from the BLE interrupt. */
+static uint16_t m_cfg_rx_len[CFG_RX_PACKETS];
+static volatile uint8_t m_cfg_rx_head = 0;                                  /**< Moved by cfg_data_handler only. */
+static volatile uint8_t m_cfg_rx_tail = 0;                                  /**< Moved by cfg_rx_process only. */
+static uint16_t m_cfg_rx_done = 0;                                          /**< Chunk bytes of the packet at m_cfg_rx_tail already with pstore. */
+static uint16_t m_cfg_rx_next = 0;                                          /**< Config offset the next chunk must start at. */
+static uint16_t m_cfg_rx_written = 0;                                       /**< Config bytes handed to pstore, a multiple of 4. */
+static uint8_t m_cfg_rx_word[sizeof(uint32_t)];                             /**< Config bytes behind m_cfg_rx_written, kept until a word is complete. */
+static uint8_t m_cfg_rx_word_len = 0;
+static bool m_cfg_rx_retry = false;                                         /**< RETRY notified, chunks are dropped until the central goes back. */
+
+static const struct
+{
+    uint32_t baud;
+    uint32_t rate;
+} m_baud_rates[] =
+{
+    {9600,    NRF_UART_BAUDRATE_9600},
+    {57600,   NRF_UART_BAUDRATE_57600},
+    {115200,  NRF_UART_BAUDRATE_115200},
+    {230400,  NRF_UART_BAUDRATE_230400},
+    {460800,  NRF_UART_BAUDRATE_460800},
+    {921600,  NRF_UART_BAUDRATE_921600},
+    {1000000, NRF_UART_BAUDRATE_1000000}
+};
 static void advertising_reinit(void);
+static void cfg_stream_send(void * p_event_data, uint16_t event_size);
 static void advertising_init(void);
                                    
 /**@brief Callback function for asserts in the SoftDevice.
@@ -180,6 +283,75 @@ static void timers_init(void)
 }
 
 
+/**@brief Function for the Event Scheduler initialization.
+ */
+static void scheduler_init(void)
+{
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+}
+
+
+/**@brief Function for handling the boot timer timeout.
+ *
+ * @details Brings up the deferred services if no radio notification arrived in time.
+ */
+static void boot_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    m_services_pending = 1;
+}
+
+
+/**@brief Function for starting the boot timer.
+ *
+ * @details The timer keeps RTC1 running from reset, so the boot phase timestamps
+ *          read with app_timer_cnt_get are relative to power up.
+ */
+static void boot_timer_start(void)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_create(&m_boot_timer_id, APP_TIMER_MODE_SINGLE_SHOT, boot_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_start(m_boot_timer_id, BOOT_DEFER_TIMEOUT, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for recording the end of a boot phase.
+ *
+ * @param[in] phase  one of the BOOT_TS_* phases.
+ */
+static void boot_ts_set(uint8_t phase)
+{
+    app_timer_cnt_get(&m_boot_ts[phase]);
+}
+
+
+/**@brief Function for building the at$bootts? reply.
+ *
+ * @details One decimal RTC1 tick count per boot phase, separated by spaces.
+ *          A phase that has not completed yet reads 0.
+ *
+ * @param[out] p_dest  reply buffer, at least BOOT_TS_REPLY_LEN bytes long.
+ *
+ * @return length of the reply, without a \0.
+ */
+static uint16_t boot_ts_reply(char * p_dest)
+{
+    uint16_t len = 0;
+
+    for (uint8_t i = 0; i < BOOT_TS_MAX; i++)
+    {
+        if (i)
+            p_dest[len++] = ' ';
+        len += longword_to_ascii((uint8_t *)p_dest + len, m_boot_ts[i]);
+    }
+    return len;
+}
+
+
 /**@brief Function for the GAP initialization.
  *
  * @details This function sets up all the necessary GAP (Generic Access Profile) parameters of the
@@ -204,14 +376,8 @@ static void gap_params_init(void)
                                           strlen(DEVICE_NAME));
     APP_ERROR_CHECK(err_code); // Check for errors
 
-    // Always initialize all fields in structs to zero or you might get unexpected behaviour
-    memset(&gap_conn_params, 0, sizeof(gap_conn_params));
-
-    // Populate the GAP connection parameter struct
-    gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
-    gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
-    gap_conn_params.slave_latency     = SLAVE_LATENCY;
-    gap_conn_params.conn_sup_timeout  = CONN_SUP_TIMEOUT;
+    // Connections start idle, a transfer asks for the fast profile.
+    gap_conn_params = m_conn_profiles[CONN_PROFILE_IDLE];
 
     // Set GAP Peripheral Preferred Connection Parameters
     // The device use these prefered values when negotiating connection terms with another device
@@ -239,7 +405,8 @@ static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 {
     uint32_t err_code;
 
-    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+    // A central that cannot do the fast profile still gets its transfer done.
+    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED && m_conn_profile == CONN_PROFILE_IDLE)
     {
         err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
@@ -257,6 +424,19 @@ static void conn_params_error_handler(uint32_t nrf_error)
 }
 
 
+/**@brief Function for handling the timeout of the connection idle timer.
+ *
+ * @details The profile is switched from the main loop.
+ *
+ * @param[in] p_context  Unused.
+ */
+static void conn_idle_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    m_conn_idle = 1;
+}
+
+
 /**@brief Function for initializing the Connection Parameters module.
  */
 static void conn_params_init(void)
@@ -277,6 +457,44 @@ static void conn_params_init(void)
 
     err_code = ble_conn_params_init(&cp_init);
     APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_conn_idle_timer_id, APP_TIMER_MODE_SINGLE_SHOT, conn_idle_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for switching the connection parameters to a profile.
+ *
+ * @details The Connection Parameters module sends the update to the central, and keeps
+ *          asking for it if the central answers with parameters outside the profile.
+ *          Without a connection only the preferred parameters are set.
+ *
+ * @param[in] profile  CONN_PROFILE_xxx.
+ */
+static void conn_profile_set(uint8_t profile)
+{
+    if (profile == m_conn_profile)
+        return;
+
+    m_conn_profile = profile;
+    // NRF_ERROR_BUSY while an update is in progress, the module retries on its completion.
+    UNUSED_VARIABLE(ble_conn_params_change_conn_params(&m_conn_profiles[profile]));
+}
+
+
+/**@brief Function for marking NUS or config traffic on the connection.
+ *
+ * @details Called from the main loop. The first transfer asks for the fast profile, the
+ *          idle profile comes back CONN_IDLE_TIMEOUT after the last one.
+ */
+static void conn_profile_activity(void)
+{
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+        return;
+
+    conn_profile_set(CONN_PROFILE_FAST);
+    UNUSED_VARIABLE(app_timer_stop(m_conn_idle_timer_id));
+    UNUSED_VARIABLE(app_timer_start(m_conn_idle_timer_id, CONN_IDLE_TIMEOUT, NULL));
 }
 
 
@@ -348,11 +566,31 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
             err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
             APP_ERROR_CHECK(err_code);
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+#ifdef S132
+            // Not every central asks for a larger MTU by itself.
+            UNUSED_VARIABLE(sd_ble_gattc_exchange_mtu_request(m_conn_handle, APP_ATT_MTU));
+#endif
             break;
 
         case BLE_GAP_EVT_DISCONNECTED:
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
+            // The next central is offered the idle parameters.
+            UNUSED_VARIABLE(app_timer_stop(m_conn_idle_timer_id));
+            m_conn_idle = 1;
+            // The next central starts with AT commands.
+            m_nus_binary = false;
+            atcmd_stream_reset(&m_nus_stream);
+            if (m_cfg_stream_source == APP_ATCMD_SRC_NUS)
+                m_cfg_streaming = false;
+            break;
+
+#ifdef S132
+        // The larger MTU lets the config service take a whole packet per write.
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+            err_code = sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle, APP_ATT_MTU);
+            APP_ERROR_CHECK(err_code);
             break;
+#endif
 
         default:
             // No implementation needed.
@@ -376,6 +614,8 @@ static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
     on_ble_evt(p_ble_evt);
     ble_advertising_on_ble_evt(p_ble_evt);
 	ble_nus_on_ble_evt(&m_nus, p_ble_evt);
+	nus_reply_on_ble_evt(p_ble_evt);
+	ble_cfg_on_ble_evt(&m_cfg, p_ble_evt);
 }
 
 
@@ -412,8 +652,17 @@ static void ble_stack_init(void)
                                                     &ble_enable_params);
     APP_ERROR_CHECK(err_code);
     
+    // One vendor specific UUID base for NUS, one for the config transfer service.
+    ble_enable_params.common_enable_params.vs_uuid_count = 2;
+
+#ifdef S132
+    // The larger MTU takes more SoftDevice RAM than the default configuration,
+    // sd_ble_enable fails with NRF_ERROR_NO_MEM if the RAM start is too low.
+    ble_enable_params.gatt_enable_params.att_mtu = APP_ATT_MTU;
+#else
     //Check the ram settings against the used number of links
     CHECK_RAM_START_ADDR(CENTRAL_LINK_COUNT,PERIPHERAL_LINK_COUNT);
+#endif
     
     // Enable BLE stack.
     err_code = softdevice_enable(&ble_enable_params);
@@ -498,10 +747,7 @@ static void device_manager_init(bool erase_bonds)
     dm_init_param_t        init_param = {.clear_persistent_data = erase_bonds};
     dm_application_param_t register_param;
 
-    // Initialize persistent storage module.
-    err_code = pstorage_init();
-    APP_ERROR_CHECK(err_code);
-
+    // The persistent storage module is initialized by pstore_init.
     err_code = dm_init(&init_param);
     APP_ERROR_CHECK(err_code);
 
@@ -523,8 +769,10 @@ static void device_manager_init(bool erase_bonds)
 }
 
 /**@brief Function for initializing the Advertising functionality.
+ *
+ * @param[in] timeout  NUS window in seconds, the beacon is advertised after it.
  */
-static void nus_advertising_init(void)
+static void nus_advertising_init(uint16_t timeout)
 {
     uint32_t      err_code;
     ble_advdata_t advdata;
@@ -543,12 +791,41 @@ static void nus_advertising_init(void)
     ble_adv_modes_config_t options = {0};
     options.ble_adv_fast_enabled  = BLE_ADV_FAST_ENABLED;
     options.ble_adv_fast_interval = APP_ADV_INTERVAL;
-    options.ble_adv_fast_timeout  = APP_ADV_NUS_TIMEOUT_IN_SECONDS;
+    options.ble_adv_fast_timeout  = timeout;
 
     err_code = ble_advertising_init(&advdata, &scanrsp, &options, on_adv_evt, NULL);
     APP_ERROR_CHECK(err_code);
 }
 
+/**@brief Function for encoding the beacon frame for a counter value.
+ *
+ * @details Plain frames carry the encrypted UUID and the counter in m_beacon_info. With
+ *          be08=1 the frame is the encrypted UUID, the counter and a 4-byte CMAC tag; the
+ *          type, length and RSSI bytes are dropped so it still fits in the advertisement.
+ *
+ * @param[in]  counter       counter value the frame is encrypted with.
+ * @param[out] p_manuf_data  manufacturer specific data pointing at the frame.
+ */
+static void beacon_frame_set(uint32_t counter, ble_advdata_manuf_data_t * p_manuf_data)
+{
+	if (m_beacon_frame == SSCAN_FRAME_CMAC)
+	{
+		sscan_ctr_crypt(&m_beacon_ctr, counter, 0, m_beacon_uuid, m_beacon_auth_info, APP_AES_LENGTH);
+		memcpy(&m_beacon_auth_info[APP_AES_LENGTH], &counter, SSCAN_COUNTER_LENGTH);
+		sscan_cmac_tag(&m_beacon_cmac, m_beacon_auth_info, APP_AES_LENGTH + SSCAN_COUNTER_LENGTH,
+		               &m_beacon_auth_info[APP_AES_LENGTH + SSCAN_COUNTER_LENGTH]);
+		p_manuf_data->data.p_data = m_beacon_auth_info;
+		p_manuf_data->data.size   = SSCAN_AUTH_FRAME_LENGTH;
+	}
+	else
+	{
+		sscan_ctr_crypt(&m_beacon_ctr, counter, 0, m_beacon_uuid, &m_beacon_info[2], APP_AES_LENGTH);
+		memcpy(&m_beacon_info[18], &counter, sizeof(counter));
+		p_manuf_data->data.p_data = (uint8_t *) m_beacon_info;
+		p_manuf_data->data.size   = APP_BEACON_INFO_LENGTH;
+	}
+}
+
 /**@brief Function for initializing the Advertising functionality.
  */
 static void advertising_init(void)
@@ -563,9 +840,7 @@ static void advertising_init(void)
     //manuf_data.data.p_data              = data;     
     //manuf_data.data.size                = sizeof(data);
 
-	encrypt_128bit_uuid(m_beacon_uuid, m_aes128_key, &m_beacon_info[2], 0);
-	manuf_data.data.p_data = (uint8_t *) m_beacon_info;
-    manuf_data.data.size   = APP_BEACON_INFO_LENGTH;
+	beacon_frame_set(0, &manuf_data);
 	
     // Build advertising data struct to pass into @ref ble_advertising_init.
     memset(&advdata, 0, sizeof(advdata));
@@ -608,7 +883,26 @@ static void advertising_init(void)
     APP_ERROR_CHECK(err_code);
 }
 
-/**@brief Function for initializing the Advertising functionality.
+/**@brief Function for reserving the next block of counter values in flash.
+ * @details m_counter_reserve stays set until the reservation is queued, so a
+ *          busy flash is retried from the main loop.
+ */
+static void counter_reserve(void)
+{
+	if (pstore_counter_reserve(m_counter_next))
+	{
+		m_counter_next += PSTORE_CNT_RESERVE;
+		m_counter_reserve = 0;
+	}
+	else
+	{
+		m_counter_reserve = 1;
+	}
+}
+
+/**@brief Function for advertising the beacon frame of the next counter value.
+ * @details The frame on air is kept while the next value is not covered by a
+ *          reservation in flash, so no value can repeat after a reset.
  */
 static void advertising_reinit(void)
 {
@@ -622,11 +916,16 @@ static void advertising_reinit(void)
     manuf_data.company_identifier       = company_id; // Nordics company ID
     //manuf_data.data.p_data              = data;     
     //manuf_data.data.size                = sizeof(data);
-	encrypt_128bit_uuid(m_beacon_uuid, m_aes128_key, &m_beacon_info[2], m_counter_ticks);
-	memcpy(&m_beacon_info[18], &m_counter_ticks, sizeof(m_counter_ticks));
+	if (m_counter_ticks >= m_counter_next)
+	{
+		m_counter_reserve = 1;
+		return;
+	}
+	beacon_frame_set(m_counter_ticks, &manuf_data);
 	m_counter_ticks++;
-	manuf_data.data.p_data = (uint8_t *) m_beacon_info;
-    manuf_data.data.size   = APP_BEACON_INFO_LENGTH;
+	// Reserve ahead, so the next block is in flash before its first value is sent.
+	if (m_counter_ticks + PSTORE_CNT_MARGIN >= m_counter_next)
+		m_counter_reserve = 1;
 	
     // Build advertising data struct to pass into @ref ble_advertising_init.
     memset(&advdata, 0, sizeof(advdata));
@@ -646,82 +945,458 @@ static void advertising_reinit(void)
     APP_ERROR_CHECK(err_code);
 }
 
-static void execute_atcmd(uint16_t index, uint8_t *data_array, char *p_resp_str)
+/**@brief Function for taking the UART settings of an at$baud command.
+ *
+ * @details The UART is switched by the main loop once the OK has been sent at the current rate.
+ *
+ * @return false if the rate is not one of m_baud_rates.
+ */
+static bool uart_baud_request(void)
+{
+    uint32_t baud;
+    bool flow_control;
+
+    atcmd_get_baud(&baud, &flow_control);
+    for (uint8_t i = 0; i < sizeof(m_baud_rates) / sizeof(m_baud_rates[0]); i++)
+    {
+        if (m_baud_rates[i].baud == baud)
+        {
+            m_baud_pending = m_baud_rates[i].rate;
+            m_flow_pending = flow_control;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**@brief Function for switching the UART to the settings taken by uart_baud_request.
+ *
+ * @details Anything but the default settings has to be confirmed by a command received at the
+ *          new rate within UART_BAUD_CONFIRM_TIMEOUT, else the UART falls back to the default.
+ */
+static void uart_baud_apply(void)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(m_baud_timer_id);
+    APP_ERROR_CHECK(err_code);
+
+    atcmd_stream_reset(&m_uart_stream);
+    binproto_reset(&m_uart_bin);
+    err_code = uart_reply_baud_set(m_baud_pending, m_flow_pending);
+    APP_ERROR_CHECK(err_code);
+
+    m_baud_unconfirmed = (m_baud_pending != UART_DEFAULT_BAUDRATE || m_flow_pending);
+    if (m_baud_unconfirmed)
+    {
+        err_code = app_timer_start(m_baud_timer_id, UART_BAUD_CONFIRM_TIMEOUT, NULL);
+        APP_ERROR_CHECK(err_code);
+    }
+    m_baud_pending = 0;
+}
+
+/**@brief Function for handling the baud timer timeout.
+ */
+static void baud_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    m_baud_revert = 1;
+}
+
+/**@brief Function for taking the beacon settings from the config entries.
+ * @details Called at boot and each time the config block is rewritten. The
+ *          key and frame are swapped with the radio notification masked, so no
+ *          beacon is built from half of them.
+ *
+ * @return true if the config holds the beacon encryption key.
+ */
+static bool config_apply(void)
+{
+	m_fast_adv_interval = CONFIG_GET(fast_adv_interval);
+
+	CRITICAL_REGION_ENTER();
+	if (CONFIG_HAS(beacon_uuid))
+	{
+		memcpy(m_beacon_uuid, CONFIG_GET(beacon_uuid), APP_AES_LENGTH);
+		sscan_set_device_uuid(0, m_beacon_uuid);
+	}
+	if (CONFIG_HAS(aes_key))
+	{
+		memcpy(m_aes128_key, CONFIG_GET(aes_key), APP_AES_LENGTH);
+		sscan_set_encryption_key(0, m_aes128_key);
+	}
+	sscan_ctr_init(&m_beacon_ctr, m_aes128_key);
+	sscan_cmac_init(&m_beacon_cmac, m_aes128_key);
+	m_beacon_frame = CONFIG_GET(beacon_frame);
+	CRITICAL_REGION_EXIT();
+	return CONFIG_HAS(aes_key);
+}
+
+/**@brief Function for loading the config entries again once the flash is rewritten.
+ * @details The entries point into flash, a patch built against the old ones would
+ *          copy stale records.
+ */
+static void config_reload(void)
 {
-	uint16_t param_size;
-	char datastr[16] = {0};
+	if (m_config_reload && !pstore_busy())
+	{
+		m_config_reload = false;
+		config_hdlr_load(pstore_get(), PSTORE_MAX_BLOCK);
+		UNUSED_VARIABLE(config_apply());
+	}
+}
+
+static uint8_t execute_atcmd(atcmd_stream_t *p_stream, atresp_t *p_resp)
+{
+	uint8_t *p_field;
+	uint8_t rc;
 	
-	memset(p_resp_str, 0, PSTORE_MAX_BLOCK + 1);
+	atresp_init(p_resp);
+	// Echo the sequence tag in front of the reply.
+	if (p_stream->tag_len)
+	{
+		p_field = atresp_reserve(p_resp, p_stream->tag_len + 2);
+		if (p_field == NULL)
+		{
+			atresp_add_str(p_resp, atcmd_get_nack());
+			return (APP_ATCMD_NOT_SUPPORTED);
+		}
+		p_field[0] = '#';
+		memcpy(p_field + 1, p_stream->tag, p_stream->tag_len);
+		p_field[p_stream->tag_len + 1] = ' ';
+		atresp_commit(p_resp, p_stream->tag_len + 2);
+	}
 	// Execute AT command.
-	switch (atcmd_parse(index, (char *)data_array)) {
+	rc = atcmd_stream_run(p_stream);
+	switch (rc) {
 		case APP_ATCMD_ACT_CONFIG_GET :
-			memcpy(p_resp_str, atcmd_get_ok(), strlen(atcmd_get_ok()));
+			// Only the size, the config itself follows from flash.
+			p_field = atresp_reserve(p_resp, CONFIG_LONGWORD_DIGITS_MAX);
+			if (p_field == NULL)
+			{
+				atresp_add_str(p_resp, atcmd_get_nack());
+				rc = APP_ATCMD_NOT_SUPPORTED;
+				break;
+			}
+			m_cfg_stream_size = pstore_get_size();
+			atresp_commit(p_resp, longword_to_ascii(p_field, m_cfg_stream_size));
 			break;
 			
 		case APP_ATCMD_ACT_CONFIG_SET :
-			memcpy(p_resp_str, atcmd_get_ok(), strlen(atcmd_get_ok()));
+		case APP_ATCMD_ACT_CONFIG_COMMIT :
+		case APP_ATCMD_ACT_CONFIG_PATCH :
+			m_config_reload = true;
+			atresp_add_str(p_resp, atcmd_get_ok());
+			break;
+
+		case APP_ATCMD_ACT_CONFIG_CHUNK :
+		case APP_ATCMD_ACT_BIN_MODE :
+			atresp_add_str(p_resp, atcmd_get_ok());
 			break;
 			
 		case APP_ATCMD_ACT_CONFIG_GET_VER :
-			if (!config_hdlr_get_string("vers", &param_size, datastr))
+			if (CONFIG_HAS(version))
+				atresp_add_str(p_resp, CONFIG_GET(version));
+			else
+				atresp_add_str(p_resp, m_nul_str);
+			break;
+			
+		case APP_ATCMD_ACT_BOOT_TS :
+			p_field = atresp_reserve(p_resp, BOOT_TS_REPLY_LEN);
+			if (p_field == NULL)
+			{
+				atresp_add_str(p_resp, atcmd_get_nack());
+				rc = APP_ATCMD_NOT_SUPPORTED;
+				break;
+			}
+			atresp_commit(p_resp, boot_ts_reply((char *)p_field));
+			break;
+			
+		case APP_ATCMD_ACT_BAUD :
+			if (uart_baud_request())
+			{
+				atresp_add_str(p_resp, atcmd_get_ok());
+			}
+			else
 			{
-				strcpy(datastr, "NUL");
+				atresp_add_str(p_resp, atcmd_get_nack());
+				rc = APP_ATCMD_NOT_SUPPORTED;
 			}
-			memcpy(p_resp_str, datastr, strlen(datastr));
 			break;
 			
 		default :
-			memcpy(p_resp_str, atcmd_get_nack(), strlen(atcmd_get_nack()));
+			atresp_add_str(p_resp, atcmd_get_nack());
 			break;
 	}
+	return (rc);
 }
 
-/**@brief   Function for handling app_uart events.
+/**@brief Function for executing a queued binary frame and encoding its reply.
  *
- * @details This function will receive a single character from the app_uart module and append it to 
- *          a string. The string will be be sent over BLE when the last character received was a 
- *          'new line' i.e '\n' (hex 0x0D) or if the string has reached a length of 
- *          @ref NUS_MAX_DATA_LENGTH.
+ * @details The opcode is the APP_ATCMD_ACT_xxx code of the command, its TLVs were loaded
+ *          into the AT command stream on arrival, so both formats share the command table,
+ *          the parameter checks and the handlers. The reply carries a status TLV and the
+ *          reply text of the AT command.
+ *
+ * @param[in] p_item  queued frame.
+ *
+ * @return size, in bytes, of the encoded reply in m_bin_frame.
  */
-void uart_event_handle(app_uart_evt_t * p_event)
+static uint16_t execute_bincmd(atcmd_queue_item_t *p_item)
 {
-	static uint8_t data_array[APP_ATCMD_MAX_DATA_LEN];
-    static uint16_t index = 0;
-	
-    switch (p_event->evt_type)
-    {
-        /**@snippet [Handling data from UART] */ 
-        case APP_UART_DATA_READY:
-            UNUSED_VARIABLE(app_uart_get(&data_array[index]));
-            index++;
-            if ((data_array[index - 1] == '\r') ||
-				(index >= (APP_ATCMD_MAX_DATA_LEN)))
-				//(index >= (BLE_NUS_MAX_DATA_LEN)))
-            {
-                /*while (ble_nus_c_string_send(&m_ble_nus_c, data_array, index) != NRF_SUCCESS)
-                {
-                    // repeat until sent.
-                }*/
-				
-				// Execute AT command.
-				execute_atcmd(index, data_array, m_atcmd_resp_str);
-				m_atcmd_resp_str[strlen(m_atcmd_resp_str)] = '\n';
-				uart_reply_string(m_atcmd_resp_str);
-                index = 0;
-            }
-            break;
-        /**@snippet [Handling data from UART] */ 
-        case APP_UART_COMMUNICATION_ERROR:
-            APP_ERROR_HANDLER(p_event->data.error_communication);
-            break;
+	uint8_t status = 0;
+	uint16_t tlv_len;
 
-        case APP_UART_FIFO_ERROR:
-            APP_ERROR_HANDLER(p_event->data.error_code);
-            break;
+	if (p_item->opcode == BINPROTO_OP_TEXT_MODE)
+	{
+		atcmd_stream_reset(&p_item->stream);
+		atresp_init(&m_atresp);
+		atresp_add_str(&m_atresp, atcmd_get_ok());
+	}
+	else if (execute_atcmd(&p_item->stream, &m_atresp) == APP_ATCMD_NOT_SUPPORTED)
+	{
+		status = 1;
+	}
 
-        default:
-            break;
+	tlv_len = binproto_tlv_put(m_bin_tlv, BINPROTO_TLV_STATUS, &status, 1);
+	m_bin_tlv[tlv_len] = BINPROTO_TLV_REPLY;
+	m_bin_tlv[tlv_len + 1] = atresp_flatten(&m_atresp, &m_bin_tlv[tlv_len + 2],
+	                                        BINPROTO_MAX_FRAME - 1 - BINPROTO_CRC_LENGTH - tlv_len - 2);
+	tlv_len += 2 + m_bin_tlv[tlv_len + 1];
+	return binproto_build(p_item->opcode, m_bin_tlv, tlv_len, m_bin_frame);
+}
+
+/**@brief Function for sending a reply to the interface a command came from.
+ *
+ * @details The segments go to the UART one after the other. For NUS they are queued
+ *          first, so that they fill whole notifications.
+ */
+static void atcmd_reply(uint8_t source, const atresp_t *p_resp)
+{
+	uint8_t i;
+
+	for (i = 0; i < p_resp->n_segs; i++)
+	{
+		if (source == APP_ATCMD_SRC_UART)
+			uart_reply_data(p_resp->seg[i].p_data, p_resp->seg[i].len);
+		else
+			UNUSED_VARIABLE(nus_reply_data(p_resp->seg[i].p_data, p_resp->seg[i].len));
+	}
+	if (source == APP_ATCMD_SRC_NUS)
+		nus_reply_send();
+}
+
+/**@brief Function for sending the next part of the config to an at$cfgget? host.
+ *
+ * @details Runs from the scheduler. The config is read from flash as far as the interface
+ *          takes it without waiting, then the UART or NUS TX done handler schedules the
+ *          next part.
+ */
+static void cfg_stream_send(void * p_event_data, uint16_t event_size)
+{
+	static uint8_t chunk[CFG_STREAM_CHUNK];
+	uint16_t len;
+
+	UNUSED_PARAMETER(p_event_data);
+	UNUSED_PARAMETER(event_size);
+
+	while (m_cfg_streaming && m_cfg_stream_offset < m_cfg_stream_size)
+	{
+		len = MIN(m_cfg_stream_size - m_cfg_stream_offset, CFG_STREAM_CHUNK);
+		if (m_cfg_stream_source == APP_ATCMD_SRC_UART)
+			len = MIN(len, uart_reply_space());
+		else
+			len = MIN(len, nus_reply_space());
+		if (len == 0)
+			break;
+
+		len = pstore_read(m_cfg_stream_offset, chunk, len);
+		if (m_cfg_stream_source == APP_ATCMD_SRC_UART)
+			uart_reply_data(chunk, len);
+		else
+			UNUSED_VARIABLE(nus_reply_data(chunk, len));
+		m_cfg_stream_offset += len;
+	}
+	if (m_cfg_stream_offset >= m_cfg_stream_size)
+		m_cfg_streaming = false;
+	if (m_cfg_stream_source == APP_ATCMD_SRC_NUS)
+	{
+		conn_profile_activity();
+		nus_reply_send();
+	}
+}
+
+/**@brief Function for starting to send the config after the at$cfgget? reply.
+ *
+ * @param[in] source  APP_ATCMD_SRC_xxx the command came from.
+ */
+static void cfg_stream_start(uint8_t source)
+{
+	if (m_cfg_stream_size == 0)
+		return;
+
+	m_cfg_stream_source = source;
+	m_cfg_stream_offset = 0;
+	m_cfg_streaming = true;
+	UNUSED_VARIABLE(app_sched_event_put(NULL, 0, cfg_stream_send));
+}
+
+/**@brief Function for handling the end of a UART transmission.
+ *
+ * @details Called from the UART interrupt, the config stream continues from the scheduler.
+ */
+static void uart_tx_done_handle(void)
+{
+	if (m_cfg_streaming && m_cfg_stream_source == APP_ATCMD_SRC_UART)
+		UNUSED_VARIABLE(app_sched_event_put(NULL, 0, cfg_stream_send));
+}
+
+/**@brief Function for handling the end of a NUS transmission.
+ *
+ * @details Called from the main loop once the queued bytes are with the SoftDevice.
+ */
+static void nus_tx_done_handle(void)
+{
+	if (m_cfg_streaming && m_cfg_stream_source == APP_ATCMD_SRC_NUS)
+		UNUSED_VARIABLE(app_sched_event_put(NULL, 0, cfg_stream_send));
+}
+
+/**@brief Function for queuing a complete command for the main loop.
+ *
+ * @details The interface mode follows the command at once, since the bytes behind
+ *          at$binmode are already frames and the ones behind a text mode frame are text.
+ *
+ * @param[in]  p_stream  complete command.
+ * @param[in]  source    APP_ATCMD_SRC_xxx of the interface.
+ * @param[in]  opcode    binary opcode or APP_ATCMD_OPCODE_TEXT.
+ * @param[in]  p_rx      COBS receiver of the interface.
+ * @param[out] p_binary  binary mode flag of the interface.
+ */
+static void atcmd_enqueue(atcmd_stream_t *p_stream, uint8_t source, uint8_t opcode,
+                          binproto_rx_t *p_rx, bool *p_binary)
+{
+	bool bin_mode = (opcode == APP_ATCMD_OPCODE_TEXT &&
+	                 atcmd_stream_action(p_stream) == APP_ATCMD_ACT_BIN_MODE);
+
+	if (!atcmd_queue_push(p_stream, source, opcode))
+	{
+		m_atcmd_dropped[source]++;
+		return;
+	}
+	if (bin_mode)
+	{
+		binproto_reset(p_rx);
+		*p_binary = true;
+	}
+	else if (opcode == BINPROTO_OP_TEXT_MODE)
+	{
+		*p_binary = false;
+	}
+}
+
+/**@brief Function for handling a complete COBS frame of an interface.
+ */
+static void bincmd_enqueue(binproto_rx_t *p_rx, atcmd_stream_t *p_stream, uint8_t source, bool *p_binary)
+{
+	uint8_t opcode = p_rx->buf[0];
+
+	if (opcode == BINPROTO_OP_TEXT_MODE)
+		atcmd_stream_reset(p_stream);
+	else
+		atcmd_stream_load(p_stream, opcode, p_rx->buf + 1, p_rx->len - 1);
+	atcmd_enqueue(p_stream, source, opcode, p_rx, p_binary);
+}
+
+/**@brief Function for executing the queued commands in order and sending their replies.
+ *
+ * @details Called from the main loop only, so replies never interleave on an interface.
+ *          Lines dropped on a full queue are answered with a NACK once the queue is empty.
+ */
+static void atcmd_queue_execute(void)
+{
+	atcmd_queue_item_t *p_item;
+	uint16_t len;
+	uint8_t source;
+	uint8_t rc;
+	bool valid;
+
+	// Replies of the waiting commands would end up inside the config.
+	while (!m_cfg_streaming && (p_item = atcmd_queue_peek()) != NULL)
+	{
+		// A write may have completed while the previous command ran.
+		config_reload();
+		rc = APP_ATCMD_NOT_SUPPORTED;
+		if (p_item->opcode == APP_ATCMD_OPCODE_TEXT)
+		{
+			rc = execute_atcmd(&p_item->stream, &m_atresp);
+			valid = (rc != APP_ATCMD_NOT_SUPPORTED);
+			if (p_item->source == APP_ATCMD_SRC_UART)
+				atresp_add_str(&m_atresp, m_newline_str);
+		}
+		else
+		{
+			len = execute_bincmd(p_item);
+			atresp_init(&m_atresp);
+			atresp_add(&m_atresp, m_bin_frame, len);
+			// A frame only gets queued with a good CRC.
+			valid = true;
+		}
+		// The host follows the rate set by at$baud.
+		if (valid && p_item->source == APP_ATCMD_SRC_UART && m_baud_unconfirmed)
+		{
+			m_baud_unconfirmed = false;
+			UNUSED_VARIABLE(app_timer_stop(m_baud_timer_id));
+		}
+		if (p_item->source == APP_ATCMD_SRC_NUS)
+			conn_profile_activity();
+		atcmd_reply(p_item->source, &m_atresp);
+		if (rc == APP_ATCMD_ACT_CONFIG_GET)
+			cfg_stream_start(p_item->source);
+		atcmd_queue_pop();
+	}
+
+	for (source = 0; source < APP_ATCMD_SRC_COUNT; source++)
+	{
+		while (m_atcmd_nacked[source] != m_atcmd_dropped[source])
+		{
+			atresp_init(&m_atresp);
+			atresp_add_str(&m_atresp, atcmd_get_nack());
+			if (source == APP_ATCMD_SRC_UART)
+				atresp_add_str(&m_atresp, m_newline_str);
+			atcmd_reply(source, &m_atresp);
+			m_atcmd_nacked[source]++;
+		}
+	}
+}
+
+/**@brief   Function for handling the bytes received on the UART.
+ *
+ * @details This function will receive a single character from the uart_reply module and feed it
+ *          to the AT command stream. The command is executed as soon as the terminating
+ *          '\r' (hex 0x0D) is received.
+ */
+static void uart_rx_handle(uint8_t data)
+{
+    if (m_uart_binary)
+    {
+		if (binproto_put(&m_uart_bin, data))
+			bincmd_enqueue(&m_uart_bin, &m_uart_stream, APP_ATCMD_SRC_UART, &m_uart_binary);
     }
+    else if (atcmd_stream_put(&m_uart_stream, (char)data))
+    {
+		// Executed from the main loop.
+		atcmd_enqueue(&m_uart_stream, APP_ATCMD_SRC_UART, APP_ATCMD_OPCODE_TEXT,
+		              &m_uart_bin, &m_uart_binary);
+    }
+}
+
+/**@brief Function for handling a byte lost on the UART.
+ * @details The line being received is incomplete, it is dropped.
+ */
+static void uart_rx_error_handle(void)
+{
+    atcmd_stream_reset(&m_uart_stream);
+    binproto_reset(&m_uart_bin);
 }
 
 /**@brief Function for initializing the UART.
@@ -730,24 +1405,25 @@ static void uart_init(void)
 {
     uint32_t err_code;
 
-    const app_uart_comm_params_t comm_params =
+    const uart_reply_config_t comm_params =
       {
-        .rx_pin_no    = RX_PIN_NUMBER,
-        .tx_pin_no    = TX_PIN_NUMBER,
-        .rts_pin_no   = RTS_PIN_NUMBER,
-        .cts_pin_no   = CTS_PIN_NUMBER,
-        .flow_control = APP_UART_FLOW_CONTROL_DISABLED,
-        .use_parity   = false,
-        .baud_rate    = UART_BAUDRATE_BAUDRATE_Baud57600
+        .rx_pin_no       = RX_PIN_NUMBER,
+        .tx_pin_no       = TX_PIN_NUMBER,
+        .rts_pin_no      = RTS_PIN_NUMBER,
+        .cts_pin_no      = CTS_PIN_NUMBER,
+        .flow_control    = false,
+        .baud_rate       = UART_DEFAULT_BAUDRATE,
+        .rx_handler      = uart_rx_handle,
+        .tx_done_handler = uart_tx_done_handle,
+        .rx_error_handler = uart_rx_error_handle
       };
 
-    APP_UART_FIFO_INIT(&comm_params,
-                        UART_RX_BUF_SIZE,
-                        UART_TX_BUF_SIZE,
-                        uart_event_handle,
-                        APP_IRQ_PRIORITY_LOW,
-                        err_code);
+    atcmd_stream_reset(&m_uart_stream);
 
+    err_code = uart_reply_init(&comm_params);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_baud_timer_id, APP_TIMER_MODE_SINGLE_SHOT, baud_timeout_handler);
     APP_ERROR_CHECK(err_code);
 }
 
@@ -786,6 +1462,11 @@ void SWI1_IRQHandler(bool radio_evt)
     if (radio_evt)
     {
         nrf_gpio_pin_toggle(BSP_LED_2); //Toggle the status of the LED on each radio notification event
+		if (!m_boot_ts[BOOT_TS_FIRST_ADV])
+		{
+			boot_ts_set(BOOT_TS_FIRST_ADV);
+			m_services_pending = 1;
+		}
 		if (!loop)
 		{
 			loop = 10;
@@ -811,27 +1492,197 @@ void SWI1_IRQHandler(bool radio_evt)
 /**@snippet [Handling the data received over BLE] */
 static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
 {
-	uint32_t err_code;
-	uint16_t cur_len = strlen((char *)m_ble_data_src);
-	
-	// Execute AT command.
-	memcpy(m_ble_data_src + cur_len, p_data, length);
-	length += cur_len;
-	// Need to have the '\r' or ';' as the terminator!
-	if (m_ble_data_src[length-1] == ';')
-		m_ble_data_src[length-1] = '\r';
+	uint16_t i;
+	char c;
 	
-	if (m_ble_data_src[length-1] != '\r')
+	for (i = 0; i < length; i++)
+	{
+		if (m_nus_binary)
+		{
+			if (binproto_put(&m_nus_bin, p_data[i]))
+				bincmd_enqueue(&m_nus_bin, &m_nus_stream, APP_ATCMD_SRC_NUS, &m_nus_binary);
+			continue;
+		}
+
+		c = (char)p_data[i];
+		// Need to have the '\r' or ';' as the terminator!
+		if (i == length - 1 && c == ';')
+			c = '\r';
+
+		if (!atcmd_stream_put(&m_nus_stream, c))
+			continue;
+
+		// Executed from the main loop.
+		atcmd_enqueue(&m_nus_stream, APP_ATCMD_SRC_NUS, APP_ATCMD_OPCODE_TEXT,
+		              &m_nus_bin, &m_nus_binary);
+	}
+}
+
+
+/**@brief Function for handling the packets written to the config transfer service.
+ *
+ * @details Called from the BLE interrupt, the packet is copied and written to flash from
+ *          the main loop. A packet that finds no room is lost, the next chunk is then out
+ *          of order and the central is told where to go back to.
+ *
+ * @param[in] p_cfg    config transfer service.
+ * @param[in] p_data   packet written by the central.
+ * @param[in] length   length of the packet.
+ */
+static void cfg_data_handler(ble_cfg_t * p_cfg, const uint8_t * p_data, uint16_t length)
+{
+	uint8_t idx;
+
+	if (length == 0 || length > BLE_CFG_MAX_DATA_LEN ||
+	    (uint8_t)(m_cfg_rx_head - m_cfg_rx_tail) >= CFG_RX_PACKETS)
 		return;
-	
-	execute_atcmd(length, m_ble_data_src, m_atcmd_resp_str);
-	err_code = ble_nus_string_send(&m_nus, (uint8_t *)m_atcmd_resp_str, strlen(m_atcmd_resp_str));
-	if (err_code != NRF_ERROR_INVALID_STATE)
+
+	idx = m_cfg_rx_head & (CFG_RX_PACKETS - 1);
+	memcpy(m_cfg_rx_buf[idx], p_data, length);
+	m_cfg_rx_len[idx] = length;
+	m_cfg_rx_head++;
+}
+
+/**@brief Function for handing one part of a config transfer to pstore.
+ *
+ * @return false if the part was refused, the transfer is dropped.
+ */
+static bool cfg_rx_write(const uint8_t *p_data, uint16_t len)
+{
+	if (!pstore_chunk_write(m_cfg_rx_written, p_data, len))
+	{
+		m_cfg_rx_next = 0;
+		m_cfg_rx_word_len = 0;
+		UNUSED_VARIABLE(ble_cfg_status_send(&m_cfg, BLE_CFG_OP_CHUNK,
+		                                    BLE_CFG_STATUS_ERROR, m_cfg_rx_next));
+		return false;
+	}
+	m_cfg_rx_written += len;
+	return true;
+}
+
+/**@brief Function for writing a config transfer packet to flash.
+ *
+ * @details A chunk is split into PSTORE_CHUNK_MAX parts as chunk buffers come free, the
+ *          parts of a chunk that wait for flash are picked up on the next call. pstore
+ *          takes whole words only, so the bytes of a chunk past its last word are kept
+ *          in RAM and written ahead of the next chunk, or on commit.
+ *
+ * @param[in] p_data   packet written by the central.
+ * @param[in] length   length of the packet.
+ *
+ * @return false if the packet waits for flash and must be given again.
+ */
+static bool cfg_rx_packet(const uint8_t *p_data, uint16_t length)
+{
+	uint16_t offset;
+	uint16_t len;
+
+	switch (p_data[0]) {
+		case BLE_CFG_OP_CHUNK :
+			if (length <= CFG_CHUNK_HEADER_LEN)
+				break;
+			offset = uint16_decode(&p_data[1]);
+			p_data += CFG_CHUNK_HEADER_LEN;
+			length -= CFG_CHUNK_HEADER_LEN;
+			// Offset 0 starts a new transfer, any other must follow the last chunk.
+			if (offset != 0 && offset != m_cfg_rx_next)
+			{
+				if (!m_cfg_rx_retry)
+				{
+					m_cfg_rx_retry = true;
+					UNUSED_VARIABLE(ble_cfg_status_send(&m_cfg, BLE_CFG_OP_CHUNK,
+					                                    BLE_CFG_STATUS_RETRY, m_cfg_rx_next));
+				}
+				return true;
+			}
+			if (offset == 0 && m_cfg_rx_done == 0)
+			{
+				m_cfg_rx_written = 0;
+				m_cfg_rx_word_len = 0;
+			}
+			for (;;)
+			{
+				// Complete the word left over, or keep the bytes past the last word.
+				if (m_cfg_rx_word_len || length - m_cfg_rx_done < sizeof(uint32_t))
+				{
+					while (m_cfg_rx_word_len < sizeof(uint32_t) && m_cfg_rx_done < length)
+						m_cfg_rx_word[m_cfg_rx_word_len++] = p_data[m_cfg_rx_done++];
+				}
+				if (m_cfg_rx_word_len == sizeof(uint32_t))
+				{
+					if (pstore_chunk_pending() >= PSTORE_CHUNK_BUFFERS)
+						return false;
+					if (!cfg_rx_write(m_cfg_rx_word, sizeof(uint32_t)))
+						return true;
+					m_cfg_rx_word_len = 0;
+					continue;
+				}
+				if (m_cfg_rx_done == length)
+					break;
+
+				if (pstore_chunk_pending() >= PSTORE_CHUNK_BUFFERS)
+					return false;
+				len = MIN(length - m_cfg_rx_done, PSTORE_CHUNK_MAX) & ~(sizeof(uint32_t) - 1);
+				if (!cfg_rx_write(p_data + m_cfg_rx_done, len))
+					return true;
+				m_cfg_rx_done += len;
+			}
+			m_cfg_rx_next = offset + length;
+			m_cfg_rx_retry = false;
+			UNUSED_VARIABLE(ble_cfg_status_send(&m_cfg, BLE_CFG_OP_CHUNK,
+			                                    BLE_CFG_STATUS_OK, m_cfg_rx_next));
+			return true;
+
+		case BLE_CFG_OP_COMMIT :
+			if (length < CFG_COMMIT_LEN)
+				break;
+			// The last bytes of the file, padded by pstore.
+			if (m_cfg_rx_word_len)
+			{
+				if (pstore_chunk_pending() >= PSTORE_CHUNK_BUFFERS)
+					return false;
+				if (!pstore_chunk_write(m_cfg_rx_written, m_cfg_rx_word, m_cfg_rx_word_len))
+					break;
+				m_cfg_rx_written += m_cfg_rx_word_len;
+				m_cfg_rx_word_len = 0;
+			}
+			// The CRC is checked against flash, every chunk must be there.
+			if (pstore_chunk_pending())
+				return false;
+			if (pstore_chunk_commit(uint16_decode(&p_data[1]), uint16_decode(&p_data[3])))
+			{
+				m_config_reload = true;
+				UNUSED_VARIABLE(ble_cfg_status_send(&m_cfg, BLE_CFG_OP_COMMIT,
+				                                    BLE_CFG_STATUS_OK, m_cfg_rx_next));
+				return true;
+			}
+			break;
+
+		default :
+			break;
+	}
+	UNUSED_VARIABLE(ble_cfg_status_send(&m_cfg, p_data[0], BLE_CFG_STATUS_ERROR, m_cfg_rx_next));
+	return true;
+}
+
+/**@brief Function for writing the queued config transfer packets to flash.
+ *
+ * @details Called from the main loop, which runs again on each flash event.
+ */
+static void cfg_rx_process(void)
+{
+	uint8_t idx;
+
+	while (m_cfg_rx_tail != m_cfg_rx_head)
 	{
-		APP_ERROR_CHECK(err_code);
+		idx = m_cfg_rx_tail & (CFG_RX_PACKETS - 1);
+		conn_profile_activity();
+		if (!cfg_rx_packet(m_cfg_rx_buf[idx], m_cfg_rx_len[idx]))
+			return;
+		m_cfg_rx_done = 0;
+		m_cfg_rx_tail++;
 	}
-	// Clear the ble command buffer.
-	memset(m_ble_data_src, 0, APP_ATCMD_MAX_DATA_LEN);			
 }
 
 
@@ -841,84 +1692,191 @@ static void services_init(void)
 {
     uint32_t       err_code;
     ble_nus_init_t nus_init;
+    ble_cfg_init_t cfg_init;
     
     memset(&nus_init, 0, sizeof(nus_init));
 
     nus_init.data_handler = nus_data_handler;
+    atcmd_stream_reset(&m_nus_stream);
     
     err_code = ble_nus_init(&m_nus, &nus_init);
     APP_ERROR_CHECK(err_code);
+    nus_reply_init(&m_nus, nus_tx_done_handle);
+
+    memset(&cfg_init, 0, sizeof(cfg_init));
+    cfg_init.data_handler = cfg_data_handler;
+
+    err_code = ble_cfg_init(&m_cfg, &cfg_init);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**@brief Function for starting the services that are not needed to advertise.
+ *
+ * @details Device manager, NUS and UART are brought up once the first advertisement
+ *          is on air, so a tag that browns out is seen by the scanners again as early
+ *          as possible.
+ */
+static void deferred_services_init(void)
+{
+    if (m_services_ready)
+        return;
+
+    device_manager_init(m_erase_bonds);
+	services_init();
+	uart_init();
+	m_services_ready = true;
+	boot_ts_set(BOOT_TS_SERVICES);
+}
+
+/**@brief Function for getting the NUS config window to open after reset.
+ *
+ * @details A provisioned tag always advertises the beacon first, the window follows once
+ *          the deferred services are up. A watchdog or lockup reset opens no window. A
+ *          power-on or brown-out, which the reset reason cannot tell apart, opens a short
+ *          one so a provisioned tag can still be reconfigured by cycling its power. A pin
+ *          or software reset, or a tag without an encryption key, gets the full window.
+ *
+ * @param[in] provisioned  true if the config holds the beacon encryption key.
+ *
+ * @return window in seconds, 0 for none.
+ */
+static uint16_t nus_window_get(bool provisioned)
+{
+    uint32_t reset_reason = 0;
+
+    UNUSED_VARIABLE(sd_power_reset_reason_get(&reset_reason));
+    UNUSED_VARIABLE(sd_power_reset_reason_clr(reset_reason));
+
+    if (!provisioned || (reset_reason & (POWER_RESETREAS_RESETPIN_Msk | POWER_RESETREAS_SREQ_Msk)))
+        return APP_ADV_NUS_TIMEOUT_IN_SECONDS;
+    if (reset_reason & (POWER_RESETREAS_DOG_Msk | POWER_RESETREAS_LOCKUP_Msk))
+        return 0;
+    return APP_ADV_NUS_SHORT_TIMEOUT_IN_SECONDS;
+}
+
+/**@brief Function for switching the advertising of a provisioned tag to the NUS window.
+ *
+ * @details The beacon resumes from on_adv_evt once the window times out. Nothing is
+ *          done if a central already connected to the beacon.
+ *
+ * @param[in] timeout  window in seconds.
+ */
+static void nus_window_open(uint16_t timeout)
+{
+    uint32_t err_code;
+
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID)
+        return;
+
+    // Radio notification must not put the beacon frame back.
+    m_adv_reinit = 0;
+    UNUSED_VARIABLE(sd_ble_gap_adv_stop());
+    nus_advertising_init(timeout);
+    err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
+    APP_ERROR_CHECK(err_code);
 }
 
 /**@brief Function for application main entry.
  */
 int main(void)
 {
-	uint8_t config_data_raw[PSTORE_MAX_BLOCK] = {0};
-	uint16_t config_size;
     uint32_t err_code;
-    bool erase_bonds;
-	uint16_t param_size;
+	bool provisioned;
+	uint16_t nus_window;
 
-    // Initialize.
+    // Initialize what the first advertisement needs. Device manager, NUS and
+    // UART follow in deferred_services_init.
     timers_init();
-    buttons_leds_init(&erase_bonds);
+    scheduler_init();
+	boot_timer_start();
+	boot_ts_set(BOOT_TS_TIMERS);
+    buttons_leds_init(&m_erase_bonds);
     ble_stack_init();
-    device_manager_init(erase_bonds);
+	boot_ts_set(BOOT_TS_STACK);
     gap_params_init();
     conn_params_init();
-	services_init();
-    nus_advertising_init();
-	
-    // Start execution.
-    //err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
-    //APP_ERROR_CHECK(err_code);
 	
 	// Matt: our code
 	// Get config data from internal flash.
-	uart_init();
 	sscan_init();
+	atcmd_init();
 	config_hdlr_init();
 	pstore_init();
 	
-	config_size = pstore_get(config_data_raw);
-	config_hdlr_parse(config_size, config_data_raw);
+	config_hdlr_load(pstore_get(), PSTORE_MAX_BLOCK);
 	
 	// Set scan parameters
-	config_hdlr_get_longword("be06", &m_fast_adv_interval);
-
-	if (config_hdlr_get_bcd("be02", &param_size, (char *)m_beacon_uuid))
-		sscan_set_device_uuid(0, m_beacon_uuid);
-	if (config_hdlr_get_bcd("be05", &param_size, (char *)m_aes128_key))
-		sscan_set_encryption_key(0, m_aes128_key);
+	provisioned = config_apply();
 	
 	// Radio notification
 	err_code = radio_notification_init(6, NRF_RADIO_NOTIFICATION_TYPE_INT_ON_INACTIVE, NRF_RADIO_NOTIFICATION_DISTANCE_800US);
     APP_ERROR_CHECK(err_code);
 
-	// Use random number for counter_tick initial value.
-	// Add some spin loop delay for the random numbers to get "ready".
-	nrf_delay_ms(10);
-	uint8_t num_rand_bytes_available;
-	err_code = sd_rand_application_bytes_available_get(&num_rand_bytes_available);
-	APP_ERROR_CHECK(err_code);
+	// Resume counter_tick past the last block reserved in flash, so scanners
+	// never see a counter value twice across resets.
+	pstore_counter_init(&m_counter_ticks);
+	m_counter_next = m_counter_ticks;
+	counter_reserve();
+	boot_ts_set(BOOT_TS_CONFIG);
 	
-	if (num_rand_bytes_available >= 4)
+	nus_window = nus_window_get(provisioned);
+	if (provisioned)
 	{
-		err_code = sd_rand_application_vector_get((uint8_t *)&m_counter_ticks, 4);
-		APP_ERROR_CHECK(err_code);
+		advertising_init();
+		advertising_reinit();
+		m_adv_reinit = 1;
+		m_nus_window = nus_window;
 	}
 	else
-		m_counter_ticks = 0;
+	{
+		// The NUS window needs its service before it is advertised.
+		deferred_services_init();
+		nus_advertising_init(nus_window);
+	}
 	
     // Start execution.
     err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
     APP_ERROR_CHECK(err_code);
+	boot_ts_set(BOOT_TS_ADV_START);
 	
     // Enter main loop.
     for (;;)
     {
         power_manage();
+		app_sched_execute();
+		if (m_services_pending)
+		{
+			m_services_pending = 0;
+			deferred_services_init();
+			if (m_nus_window)
+			{
+				nus_window_open(m_nus_window);
+				m_nus_window = 0;
+			}
+		}
+		if (m_counter_reserve)
+			counter_reserve();
+		config_reload();
+		atcmd_queue_execute();
+		cfg_rx_process();
+		config_reload();
+		if (m_conn_idle)
+		{
+			m_conn_idle = 0;
+			conn_profile_set(CONN_PROFILE_IDLE);
+		}
+		if (m_baud_revert)
+		{
+			m_baud_revert = 0;
+			if (m_baud_unconfirmed)
+			{
+				m_baud_pending = UART_DEFAULT_BAUDRATE;
+				m_flow_pending = false;
+			}
+		}
+		// Switch once the at$baud reply has gone out at the current rate.
+		if (m_baud_pending && uart_reply_idle())
+			uart_baud_apply();
     }
 }
 
@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "ble.h"
+#include "ble_nus.h"
+#include "app_scheduler.h"
+#include "app_util_platform.h"
+#include "nus_reply.h"
+
+static ble_nus_t					*m_p_nus = NULL;
+static nus_reply_tx_done_handler_t	m_tx_done_handler;
+static uint8_t						m_buf[NUS_REPLY_BUF_LEN];
+static uint16_t						m_head = 0;     // written by nus_reply_data only
+static uint16_t						m_tail = 0;     // moved by the scheduled pump only
+static volatile uint8_t				m_tx_credits = 0;   // notifications the SoftDevice still takes
+
+/**@brief Function to notify the queued bytes, as many notifications as the SoftDevice takes.
+ * @details Runs from the main loop only. Each notification carries BLE_NUS_MAX_DATA_LEN
+ *          bytes, the last one what is left. The NUS TX characteristic is sized for the
+ *          default ATT MTU, a larger MTU does not give longer notifications.
+ */
+static void nus_reply_pump(void)
+{
+	static uint8_t packet[BLE_NUS_MAX_DATA_LEN];
+	uint32_t err_code = NRF_SUCCESS;
+	uint16_t len;
+	uint16_t i;
+	bool sent = false;
+
+	if (m_p_nus == NULL)
+		return;
+
+	while (m_tx_credits && m_head != m_tail)
+	{
+		len = MIN((uint16_t)(m_head - m_tail), BLE_NUS_MAX_DATA_LEN);
+		for (i = 0; i < len; i++)
+			packet[i] = m_buf[(m_tail + i) & (NUS_REPLY_BUF_LEN - 1)];
+
+		err_code = ble_nus_string_send(m_p_nus, packet, len);
+		if (err_code == BLE_ERROR_NO_TX_BUFFERS)
+			break;
+		if (err_code != NRF_SUCCESS)
+		{
+			// Not connected or notifications off, nobody is listening.
+			m_tail = m_head;
+			break;
+		}
+
+		m_tail += len;
+		sent = true;
+		CRITICAL_REGION_ENTER();
+		m_tx_credits--;
+		CRITICAL_REGION_EXIT();
+	}
+
+	if (m_head == m_tail && (sent || err_code != NRF_SUCCESS) && m_tx_done_handler != NULL)
+		m_tx_done_handler();
+}
+
+static void nus_reply_pump_evt(void * p_event_data, uint16_t event_size)
+{
+	UNUSED_PARAMETER(p_event_data);
+	UNUSED_PARAMETER(event_size);
+	nus_reply_pump();
+}
+
+static void nus_reply_flush_evt(void * p_event_data, uint16_t event_size)
+{
+	UNUSED_PARAMETER(p_event_data);
+	UNUSED_PARAMETER(event_size);
+	m_tail = m_head;
+}
+
+/**@brief Function to start sending replies over a NUS service.
+ *
+ * @param[in] p_nus            initialized NUS service.
+ * @param[in] tx_done_handler  optional, called from the main loop once all queued bytes
+ *                             have been handed to the SoftDevice.
+ */
+void nus_reply_init(ble_nus_t *p_nus, nus_reply_tx_done_handler_t tx_done_handler)
+{
+	m_p_nus = p_nus;
+	m_tx_done_handler = tx_done_handler;
+}
+
+/**@brief Function for handling the BLE events that pace the notifications.
+ * @details Called from the BLE event interrupt, the work is done from the scheduler.
+ */
+void nus_reply_on_ble_evt(ble_evt_t *p_ble_evt)
+{
+	uint8_t count;
+
+	switch (p_ble_evt->header.evt_id)
+	{
+		case BLE_GAP_EVT_CONNECTED:
+			if (sd_ble_tx_buffer_count_get(&count) != NRF_SUCCESS)
+				count = 1;
+			m_tx_credits = count;
+			break;
+
+		case BLE_GAP_EVT_DISCONNECTED:
+			m_tx_credits = 0;
+			UNUSED_VARIABLE(app_sched_event_put(NULL, 0, nus_reply_flush_evt));
+			break;
+
+		case BLE_EVT_TX_COMPLETE:
+			m_tx_credits += p_ble_evt->evt.common_evt.params.tx_complete.count;
+			UNUSED_VARIABLE(app_sched_event_put(NULL, 0, nus_reply_pump_evt));
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**@brief Function to queue bytes for notification.
+ * @details Nothing is sent before nus_reply_send, so the parts of a reply fill
+ *          whole notifications.
+ *
+ * @param[in] p_data  bytes to send.
+ * @param[in] len     size, in bytes, of the data.
+ *
+ * @return number of bytes queued, less than len if the buffer is full.
+ */
+uint16_t nus_reply_data(const uint8_t *p_data, uint16_t len)
+{
+	uint16_t i;
+
+	len = MIN(len, nus_reply_space());
+	for (i = 0; i < len; i++)
+		m_buf[(m_head + i) & (NUS_REPLY_BUF_LEN - 1)] = p_data[i];
+	m_head += len;
+	return (len);
+}
+
+/**@brief Function to notify the queued bytes.
+ */
+void nus_reply_send(void)
+{
+	nus_reply_pump();
+}
+
+/**@brief Function to get how many bytes nus_reply_data takes.
+ */
+uint16_t nus_reply_space(void)
+{
+	return (NUS_REPLY_BUF_LEN - (uint16_t)(m_head - m_tail));
+}
+
+/**@brief Function to check that every queued byte has been handed to the SoftDevice.
+ */
+bool nus_reply_idle(void)
+{
+	return (m_head == m_tail);
+}
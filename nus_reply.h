@@ -0,0 +1,15 @@
+#ifndef NUS_REPLY_H__
+#define NUS_REPLY_H__
+
+#define NUS_REPLY_BUF_LEN       256    // bytes waiting for a notification, power of 2
+
+typedef void (*nus_reply_tx_done_handler_t)(void);
+
+void nus_reply_init(ble_nus_t *p_nus, nus_reply_tx_done_handler_t tx_done_handler);
+void nus_reply_on_ble_evt(ble_evt_t *p_ble_evt);
+uint16_t nus_reply_data(const uint8_t *p_data, uint16_t len);
+void nus_reply_send(void);
+uint16_t nus_reply_space(void);
+bool nus_reply_idle(void);
+
+#endif  /* _ NUS_REPLY_H__ */
@@ -33,12 +33,32 @@
 //#include "SEGGER_RTT.h"
 
 #include "pstore.h"
+#include "util.h"
+#include "config_hdlr.h"
 
-static uint8_t             m_pstore_buffer[PSTORE_MAX_BLOCK];
+#define PSTORE_CNT_SLOT_SIZE   16    // smallest block pstorage accepts
+#define PSTORE_CNT_PAGES       2     // pages written in turn, one is erased while the other holds the counter
+#define PSTORE_CNT_EMPTY       0xFFFFFFFF
+
+static uint8_t             m_pstore_buffer[PSTORE_MAX_BLOCK];   // image being written, pstorage reads it until the store completes
 static pstorage_handle_t   m_handle;
 static pstorage_handle_t   m_block_0_handle;
 static uint8_t             m_wait_flag = 0;
 static pstorage_block_t    m_wait_handle = 0;
+static volatile uint8_t    m_block_pending = 0;      // config block operations not completed yet
+
+static pstorage_handle_t   m_cnt_handle;
+static uint16_t            m_cnt_page_slots;         // slots in one flash page
+static uint16_t            m_cnt_next_slot = 0;
+static uint32_t            m_cnt_slot_data[PSTORE_CNT_SLOT_SIZE / sizeof(uint32_t)];
+
+static pstorage_handle_t   m_stage_handle;
+static bool                m_stage_ready = false;
+static volatile bool       m_stage_failed = false;
+static uint16_t            m_stage_next = 0;         // offset the next chunk must start at
+static volatile uint8_t    m_chunk_pending = 0;      // chunk stores not completed yet
+static uint8_t             m_chunk_next_buffer = 0;
+static uint32_t            m_chunk_buffer[PSTORE_CHUNK_BUFFERS][PSTORE_CHUNK_MAX / sizeof(uint32_t)];
 
 /**@brief Function for the Power manager.
  */
@@ -59,6 +79,17 @@ static void pstore_handler(pstorage_handle_t  * handle,
 		//If we are waiting for this callback, clear the wait flag.
 		m_wait_flag = 0;
 	}
+
+	if (handle->block_id == m_block_0_handle.block_id && m_block_pending)
+		m_block_pending--;
+
+	if (m_stage_ready && handle->block_id == m_stage_handle.block_id)
+	{
+		if (op_code == PSTORAGE_STORE_OP_CODE && m_chunk_pending)
+			m_chunk_pending--;
+		if (result != NRF_SUCCESS)
+			m_stage_failed = true;
+	}
 	
 	switch(op_code)
 	{
@@ -112,9 +143,16 @@ static void pstore_handler(pstorage_handle_t  * handle,
 	}			
 }
 
+/**@brief Function for registering the counter, staging and config areas.
+ * @details pstorage hands out pages upwards in the order of registration. The
+ *          counter and staging areas take the three pages below the config page, so
+ *          the config keeps the address of the firmware that only had it. The
+ *          device manager registers after this, on the page above.
+ */
 bool pstore_init(void)
 {
     uint32_t retval;
+    pstorage_handle_t handle;
     pstorage_module_param_t param;
 
     retval = pstorage_init();
@@ -123,6 +161,29 @@ bool pstore_init(void)
 		return false;	
     }
 	//SEGGER_RTT_printf(0, "pstore: init ok\n");
+    m_cnt_page_slots  = PSTORAGE_FLASH_PAGE_SIZE / PSTORE_CNT_SLOT_SIZE;
+    param.block_size  = PSTORE_CNT_SLOT_SIZE;
+    param.block_count = m_cnt_page_slots * PSTORE_CNT_PAGES;
+    param.cb          = pstore_handler;
+
+    retval = pstorage_register(&param, &m_cnt_handle);
+    if (retval != NRF_SUCCESS)
+    {
+        return false;
+    }
+
+    param.block_size  = PSTORE_MAX_BLOCK;
+    param.block_count = 1;
+    param.cb          = pstore_handler;
+
+    retval = pstorage_register(&param, &handle);
+    if (retval != NRF_SUCCESS)
+    {
+        return false;
+    }
+    pstorage_block_identifier_get(&handle, 0, &m_stage_handle);
+    m_stage_ready = true;
+
     param.block_size  = PSTORE_MAX_BLOCK;                   //Select block size of 512 bytes
     param.block_count = 1;                   //Select 1 block, total of 512 bytes
     param.cb          = pstore_handler;   //Set the pstorage callback handler
@@ -137,52 +198,340 @@ bool pstore_init(void)
     return true;
 }
 
-uint16_t pstore_get(uint8_t *p_dest)
+/**@brief Function for getting the config block, mapped in flash.
+ * @details The block holds a binary config image, or the ascii file of an
+ *          older firmware. config_hdlr_load takes either.
+ */
+const uint8_t *pstore_get(void)
+{
+    return (const uint8_t *)m_block_0_handle.block_id;
+}
+
+/**@brief Function for getting the size of the config file without loading it.
+ * @details A binary image is measured as the ascii file it reads back as, an
+ *          ascii file is scanned in flash for the 0x00 ending it.
+ *
+ * @return size, in bytes, of the config file or 0 if there is none.
+ */
+uint16_t pstore_get_size(void)
 {
+    const uint8_t *p_config = (const uint8_t *)m_block_0_handle.block_id;
     uint16_t i;
-    uint32_t retval;
-    retval = pstorage_load(m_pstore_buffer, &m_block_0_handle, PSTORE_MAX_BLOCK, 0); // Read 1 block from flash
-    if(retval != NRF_SUCCESS)
-    {
-		return 0;
-    }
-	//SEGGER_RTT_printf(0, "pstore: load ok\n");
-    // The ascii file is terminated by 0x00. Search for the very first 0x00.
+
+    if (config_hdlr_is_image(p_config))
+		return config_hdlr_text_size(p_config, PSTORE_MAX_BLOCK);
+
     for (i = 0; i < PSTORE_MAX_BLOCK; i++)
     {
-	if (m_pstore_buffer[i] == 0x00)
-	    break;
+	if (p_config[i] == 0x00)
+	    return (i);
     }
-    if (i == PSTORE_MAX_BLOCK)
+    return 0;
+}
+
+/**@brief Function for reading part of the config file straight from flash.
+ * @details The lines of a binary image are rebuilt as ascii.
+ *
+ * @param[in]  offset  byte offset in the config file.
+ * @param[out] p_dest  destination of the bytes.
+ * @param[in]  len     number of bytes to read.
+ *
+ * @return number of bytes read, less than len at the end of the config block.
+ */
+uint16_t pstore_read(uint16_t offset, uint8_t *p_dest, uint16_t len)
+{
+    const uint8_t *p_config = (const uint8_t *)m_block_0_handle.block_id;
+
+    if (config_hdlr_is_image(p_config))
+		return config_hdlr_text_read(p_config, PSTORE_MAX_BLOCK, offset, p_dest, len);
+
+    if (offset >= PSTORE_MAX_BLOCK)
 		return 0;
+    if (len > PSTORE_MAX_BLOCK - offset)
+		len = PSTORE_MAX_BLOCK - offset;
 
-    memcpy(p_dest, m_pstore_buffer, i);
-    return (i);
+    memcpy(p_dest, p_config + offset, len);
+    return (len);
 }
 
-bool pstore_set(uint8_t *p_src, uint16_t len)
+/**@brief Function for writing the image in m_pstore_buffer over the config block.
+ */
+static bool pstore_image_store(uint16_t len)
 {
     uint32_t retval;
 
-	if (len >= PSTORE_MAX_BLOCK)
-		return false;
-	
-    memset(m_pstore_buffer, 0, PSTORE_MAX_BLOCK);
-    memcpy(m_pstore_buffer, p_src, len);
+    m_block_pending += 2;
     retval = pstorage_clear(&m_block_0_handle, PSTORE_MAX_BLOCK);                       
     if(retval != NRF_SUCCESS)
     {
+		m_block_pending -= 2;
 		return false;
     }
 	//SEGGER_RTT_printf(0, "pstore: clear ok\n");
     //Store data to the block. Wait for the last store operation to finish before reading out the data.
-    pstorage_store(&m_block_0_handle, m_pstore_buffer, PSTORE_MAX_BLOCK, 0);
+    retval = pstorage_store(&m_block_0_handle, m_pstore_buffer,
+                            (len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1), 0);
     if(retval != NRF_SUCCESS)
     {
-         return false;
+		m_block_pending--;
+		return false;
     }
 	//SEGGER_RTT_printf(0, "pstore: store ok\n");	
     m_wait_handle = m_block_0_handle.block_id;            //Specify which pstorage handle to wait for
     m_wait_flag = 1;                                    //Set the wait flag. Cleared in the pstore_handler
     return true;
 }
+
+/**@brief Function for storing an ascii config file.
+ * @details The file is converted once into a binary image, which is what the
+ *          config block holds. Only the words of the image are written.
+ *
+ * @param[in] p_src  ascii config file.
+ * @param[in] len    size, in bytes, of the file.
+ *
+ * @return false if the file does not convert or the flash is busy.
+ */
+bool pstore_set(uint8_t *p_src, uint16_t len)
+{
+	if (len >= PSTORE_MAX_BLOCK || m_block_pending)
+		return false;
+	
+    memset(m_pstore_buffer, 0, PSTORE_MAX_BLOCK);
+    len = config_hdlr_encode(p_src, len, m_pstore_buffer, PSTORE_MAX_BLOCK);
+    if (len == 0)
+    {
+		return false;
+    }
+    return pstore_image_store(len);
+}
+
+/**@brief Function for storing one config entry change.
+ * @details The delta is appended behind the image and the deltas already in
+ *          the block, so a change costs a few words of flash and no erase.
+ *          Once the block is full, or holds an older ascii file, the image is
+ *          rebuilt from the loaded config with the change applied, and rewritten.
+ *          The config is loaded again once pstore_busy is false.
+ *
+ * @param[in] p_delta  delta from config_hdlr_delta_encode.
+ * @param[in] len      size, in bytes, of the delta.
+ *
+ * @return false if the flash is busy or the config no longer fits.
+ */
+bool pstore_patch(const uint8_t *p_delta, uint16_t len)
+{
+    uint32_t retval;
+    uint16_t used;
+
+    if (m_block_pending || len > PSTORE_MAX_BLOCK)
+		return false;
+
+    used = config_hdlr_block_used((const uint8_t *)m_block_0_handle.block_id, PSTORE_MAX_BLOCK);
+    if (used == 0 || used + len > PSTORE_MAX_BLOCK)
+    {
+		memset(m_pstore_buffer, 0, PSTORE_MAX_BLOCK);
+		len = config_hdlr_image_build(m_pstore_buffer, PSTORE_MAX_BLOCK, p_delta);
+		if (len == 0)
+		{
+			return false;
+		}
+		return pstore_image_store(len);
+    }
+
+    memcpy(m_pstore_buffer, p_delta, len);
+    m_block_pending++;
+    retval = pstorage_store(&m_block_0_handle, m_pstore_buffer, len, used);
+    if (retval != NRF_SUCCESS)
+    {
+		m_block_pending--;
+		return false;
+    }
+    return true;
+}
+
+/**@brief Function for checking the config block still has flash operations queued.
+ * @details m_pstore_buffer is in use until then, pstore_set and pstore_patch fail.
+ */
+bool pstore_busy(void)
+{
+    return (m_block_pending != 0);
+}
+
+/**@brief Function for restoring the advertising counter from the counter page.
+ * @details The counter area is a ring of 16-byte slots over two flash pages. Each
+ *          slot holds a reserved counter value followed by its complement, so a
+ *          slot torn by a reset is ignored. The highest valid slot is the highest
+ *          value handed out so far, writing resumes behind it.
+ *
+ * @param[out] p_counter  counter value to resume from. Set to 0 on a blank page.
+ */
+bool pstore_counter_init(uint32_t *p_counter)
+{
+    uint32_t retval;
+    uint32_t slot[2];
+    pstorage_handle_t slot_handle;
+    uint16_t slots = m_cnt_page_slots * PSTORE_CNT_PAGES;
+    uint16_t last_slot = slots - 1;
+    uint16_t i;
+    bool found = false;
+
+    *p_counter = 0;
+    for (i = 0; i < slots; i++)
+    {
+        pstorage_block_identifier_get(&m_cnt_handle, i, &slot_handle);
+        retval = pstorage_load((uint8_t *)slot, &slot_handle, sizeof(slot), 0);
+        if (retval != NRF_SUCCESS || slot[0] == PSTORE_CNT_EMPTY || slot[0] != ~slot[1])
+            continue;
+        // Every value below the next reservation may already have been on air.
+        if (!found || slot[0] + PSTORE_CNT_RESERVE > *p_counter)
+        {
+            *p_counter = slot[0] + PSTORE_CNT_RESERVE;
+            last_slot = i;
+            found = true;
+        }
+    }
+
+    // Skip slots torn behind the last one, a new page is erased before use.
+    for (m_cnt_next_slot = last_slot + 1; m_cnt_next_slot % m_cnt_page_slots; m_cnt_next_slot++)
+    {
+        pstorage_block_identifier_get(&m_cnt_handle, m_cnt_next_slot, &slot_handle);
+        retval = pstorage_load((uint8_t *)slot, &slot_handle, sizeof(slot), 0);
+        if (retval == NRF_SUCCESS && slot[0] == PSTORE_CNT_EMPTY && slot[1] == PSTORE_CNT_EMPTY)
+            break;
+    }
+    return found;
+}
+
+/**@brief Function for reserving a block of counter values in flash.
+ * @details Writes into the next erased slot. A page of the ring is erased when
+ *          writing enters it, while the last reservation is still valid in the
+ *          other page, so a reset during the erase never loses the counter. A
+ *          whole page is erased in place, without the pstorage swap page.
+ *          With 4 KB pages a counter page is erased once every 512 reservations,
+ *          131072 counter values. At the fastest be06 rate, 20 ms with a new value
+ *          every 11 advertising events, that is 10000 erases in about 9 years.
+ *
+ * @param[in] value  first counter value of the reserved block.
+ *
+ * @return false if the flash is busy, the caller retries.
+ */
+bool pstore_counter_reserve(uint32_t value)
+{
+    uint32_t retval;
+    pstorage_handle_t slot_handle;
+
+    if (m_cnt_next_slot >= m_cnt_page_slots * PSTORE_CNT_PAGES)
+        m_cnt_next_slot = 0;
+
+    pstorage_block_identifier_get(&m_cnt_handle, m_cnt_next_slot, &slot_handle);
+    if (!(m_cnt_next_slot % m_cnt_page_slots))
+    {
+        retval = pstorage_clear(&slot_handle, PSTORAGE_FLASH_PAGE_SIZE);
+        if (retval != NRF_SUCCESS)
+        {
+            return false;
+        }
+    }
+
+    memset(m_cnt_slot_data, 0xFF, sizeof(m_cnt_slot_data));
+    m_cnt_slot_data[0] = value;
+    m_cnt_slot_data[1] = ~value;
+    retval = pstorage_store(&slot_handle, (uint8_t *)m_cnt_slot_data, PSTORE_CNT_SLOT_SIZE, 0);
+    if (retval != NRF_SUCCESS)
+    {
+        return false;
+    }
+    m_cnt_next_slot++;
+    return true;
+}
+
+/**@brief Function for writing one config chunk into the staging area.
+ * @details Chunks must arrive in order. A chunk at offset 0 erases the staging
+ *          area and starts a new transfer. Every chunk except the last one must
+ *          be a multiple of 4 bytes, the last one is padded with 0x00.
+ *
+ * @param[in] offset  byte offset of the chunk in the config file.
+ * @param[in] p_src   chunk data, copied before returning.
+ * @param[in] len     size, in bytes, of the chunk.
+ *
+ * @return false if the chunk is out of order, too large or both chunk
+ *         buffers are still waiting for flash.
+ */
+bool pstore_chunk_write(uint16_t offset, const uint8_t *p_src, uint16_t len)
+{
+    uint32_t retval;
+    uint8_t *p_buffer;
+
+    if (!m_stage_ready || len == 0 || len > PSTORE_CHUNK_MAX ||
+        offset + len >= PSTORE_MAX_BLOCK || m_chunk_pending >= PSTORE_CHUNK_BUFFERS)
+    {
+        return false;
+    }
+
+    if (offset == 0)
+    {
+        retval = pstorage_clear(&m_stage_handle, PSTORE_MAX_BLOCK);
+        if (retval != NRF_SUCCESS)
+        {
+            return false;
+        }
+        m_stage_next = 0;
+        m_stage_failed = false;
+    }
+
+    // A chunk that is not word sized closes the transfer.
+    if (offset != m_stage_next || (offset % sizeof(uint32_t)))
+    {
+        return false;
+    }
+
+    p_buffer = (uint8_t *)m_chunk_buffer[m_chunk_next_buffer];
+    memset(p_buffer, 0, PSTORE_CHUNK_MAX);
+    memcpy(p_buffer, p_src, len);
+
+    m_chunk_pending++;
+    retval = pstorage_store(&m_stage_handle, p_buffer,
+                            (len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1), offset);
+    if (retval != NRF_SUCCESS)
+    {
+        m_chunk_pending--;
+        return false;
+    }
+    m_chunk_next_buffer = (m_chunk_next_buffer + 1) % PSTORE_CHUNK_BUFFERS;
+    m_stage_next = offset + len;
+    return true;
+}
+
+/**@brief Function for committing the staged config file.
+ * @details The staged bytes are checked against the CRC in place and then
+ *          copied into the config block.
+ *
+ * @param[in] len  size, in bytes, of the config file.
+ * @param[in] crc  CRC-16/CCITT of the config file.
+ *
+ * @return false if chunks are still being written, or the size or CRC differ.
+ */
+bool pstore_chunk_commit(uint16_t len, uint16_t crc)
+{
+    const uint8_t *p_stage = (const uint8_t *)m_stage_handle.block_id;
+
+    if (!m_stage_ready || m_chunk_pending || m_stage_failed ||
+        len == 0 || len != m_stage_next)
+    {
+        return false;
+    }
+
+    if (crc16_ccitt(p_stage, len, CRC16_CCITT_INIT) != crc)
+    {
+        return false;
+    }
+    return pstore_set((uint8_t *)p_stage, len);
+}
+
+/**@brief Function for getting the number of chunks still waiting for flash.
+ * @details pstore_chunk_write takes a chunk while this is below
+ *          PSTORE_CHUNK_BUFFERS, pstore_chunk_commit once it is 0.
+ */
+uint8_t pstore_chunk_pending(void)
+{
+    return m_chunk_pending;
+}
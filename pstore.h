@@ -1,9 +1,22 @@
 #ifndef PSTORE_H__
 #define PSTORE_H__
 										
-#define PSTORE_MAX_BLOCK       1024  // 512 bytes to hold ascii config file
+#define PSTORE_MAX_BLOCK       1024  // config block, binary image of the ascii config file
+#define PSTORE_CNT_RESERVE     256   // counter values reserved by each flash write
+#define PSTORE_CNT_MARGIN      128   // values left in a reserved block when the next one is reserved
+#define PSTORE_CHUNK_MAX       64    // largest config chunk, multiple of 4
+#define PSTORE_CHUNK_BUFFERS   4     // chunks in flight, one BLE config packet
 
 bool pstore_init(void);
-uint16_t pstore_get(uint8_t *p_dest);
+const uint8_t *pstore_get(void);
+uint16_t pstore_get_size(void);
+uint16_t pstore_read(uint16_t offset, uint8_t *p_dest, uint16_t len);
 bool pstore_set(uint8_t *p_src, uint16_t len);
+bool pstore_patch(const uint8_t *p_delta, uint16_t len);
+bool pstore_busy(void);
+bool pstore_counter_init(uint32_t *p_counter);
+bool pstore_counter_reserve(uint32_t value);
+bool pstore_chunk_write(uint16_t offset, const uint8_t *p_src, uint16_t len);
+bool pstore_chunk_commit(uint16_t len, uint16_t crc);
+uint8_t pstore_chunk_pending(void);
 #endif  /* _ PSTORE_H__ */
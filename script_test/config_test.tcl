@@ -12,6 +12,25 @@ proc serial_set_115200 {comport} {
 	return $serial
 }
 
+# Switch the device, then the port, to another rate. Once switched the
+# device expects a command at the new rate within 3 seconds, else it falls
+# back to 57600 without flow control.
+proc serial_baud {fd rate {flow 0}} {
+	puts -nonewline $fd "at\$baud $rate $flow"
+	puts -nonewline $fd "\r"
+	# Leave time for the OK to come back at the current rate.
+	after 100
+	if {$flow} {
+		fconfigure $fd -mode "$rate,n,8,1" -handshake rtscts
+	} else {
+		fconfigure $fd -mode "$rate,n,8,1" -handshake none
+	}
+	after 50
+	puts -nonewline $fd "at\$bootts?"
+	puts -nonewline $fd "\r"
+	return
+}
+
 proc serial_receiver { chan } {
      if { [eof $chan] } {
          puts stderr "Closing $chan"
@@ -69,3 +88,47 @@ proc config_parse {filename} {
 	#puts -nonewline "at\$cfgset $version [string length $configbody] $configbody"	
 	return
  }
+
+proc crc16_ccitt {data} {
+	set crc 0xFFFF
+	foreach ch [split $data ""] {
+		set crc [expr {$crc ^ ([scan $ch %c] << 8)}]
+		for {set i 0} {$i < 8} {incr i} {
+			if {$crc & 0x8000} {
+				set crc [expr {(($crc << 1) ^ 0x1021) & 0xFFFF}]
+			} else {
+				set crc [expr {($crc << 1) & 0xFFFF}]
+			}
+		}
+	}
+	return $crc
+}
+
+ # Send the config in 64-byte chunks, then commit it with its size and CRC.
+ proc config_send_chunked {fd filename} {
+	set configbody [config_parse $filename]
+	if {$configbody == ""} {
+		puts "config file empty"
+		return
+	}
+	set chunksize 64
+	set size [string length $configbody]
+	for {set offset 0} {$offset < $size} {incr offset $chunksize} {
+		set chunk [string range $configbody $offset [expr {$offset + $chunksize - 1}]]
+		# Tagged with its offset, the reply comes back as "#<offset> OK".
+		puts -nonewline $fd "#$offset at\$cfgchunk $offset $chunk"
+		puts -nonewline $fd "\r"
+		# Leave time for the chunk to reach flash before the next one.
+		after 50
+	}
+	puts -nonewline $fd "at\$cfgcommit $size [crc16_ccitt $configbody]"
+	puts -nonewline $fd "\r"
+	return
+ }
+
+ # Change one entry of the stored config, e.g. config_patch $fd be08 1.
+ proc config_patch {fd key value} {
+	puts -nonewline $fd "at\$cfgpatch $key=$value"
+	puts -nonewline $fd "\r"
+	return
+ }
@@ -9,46 +9,171 @@ static secure_scan_data_t beacons[APP_MAX_BEACON];
 static uint8_t m_cur_state;
 static uint32_t m_counter = 0x7c845f92;
 
-/**@brief Function for the AES128 encryption of the 16-byte UUID.
- * @details Use the built-in h/w encryption engine.
+/**@brief Function for loading a key into a CTR context.
+ * @details The nonce template is filled once here instead of on every block.
  * 
- * @param[in] p_data  pointer to the 16-byte UUID array
+ * @param[out] p_ctx  CTR context to initialize
  * @param[in] p_key   pointer to a 16-byte key array
- * @param[out] p_out  pointer to the encrypted 16-byte UUID array
+ */
+void sscan_ctr_init(sscan_ctr_ctx_t *p_ctx, const uint8_t *p_key)
+{
+	memcpy(p_ctx->ecb.key, p_key, APP_AES_LENGTH);
+	memset(p_ctx->ecb.cleartext, SSCAN_NONCE_FILL, APP_AES_LENGTH);
+	p_ctx->ks_counter = 0;
+	p_ctx->ks_blocks = 0;
+	memcpy(&p_ctx->ecb.cleartext[0], &p_ctx->ks_counter, sizeof(p_ctx->ks_counter));
+}
+
+/**@brief Function for encrypting keystream block n of the counter loaded in the context.
+ * @details The block index is folded into bytes 14 and 15 of the nonce template, so
+ *          block 0 is the keystream of the original single block scheme.
+ */
+static void ctr_block_encrypt(sscan_ctr_ctx_t *p_ctx, uint16_t block)
+{
+	p_ctx->ecb.cleartext[APP_AES_LENGTH - 2] = SSCAN_NONCE_FILL ^ (uint8_t)(block >> 8);
+	p_ctx->ecb.cleartext[APP_AES_LENGTH - 1] = SSCAN_NONCE_FILL ^ (uint8_t)block;
+	sd_ecb_block_encrypt(&p_ctx->ecb);
+}
+
+/**@brief Function for the AES128-CTR encryption (or decryption) of a buffer.
+ * @details Use the built-in h/w encryption engine. Block n of a counter uses the
+ *          nonce template with the counter in bytes 0..3 and n in bytes 14..15.
+ *          The first SSCAN_CTR_MAX_BLOCKS keystream blocks of a counter are cached,
+ *          blocks past them are encrypted on every call. Fields sent under the
+ *          same counter must use distinct keystream offsets, a keystream byte is
+ *          never to be used twice.
+ * 
+ * @param[in] p_ctx   CTR context holding the key
  * @param[in] counter new counter value. Should be incrementing...
+ * @param[in] offset  keystream byte the first byte of p_in is combined with
+ * @param[in] p_in    pointer to the data to encrypt
+ * @param[out] p_out  pointer to the encrypted data, may be the same as p_in
+ * @param[in] len     number of bytes
  */
-void encrypt_128bit_uuid (uint8_t *p_data, uint8_t *p_key, uint8_t *p_out, uint32_t counter)
+void sscan_ctr_crypt(sscan_ctr_ctx_t *p_ctx, uint32_t counter, uint16_t offset,
+                     const uint8_t *p_in, uint8_t *p_out, uint16_t len)
 {
-	nrf_ecb_hal_data_t aes_struct;
-	uint8_t aes_data[APP_AES_LENGTH];
+	const uint8_t *p_ks = NULL;
+	uint32_t pos;
+	uint16_t block;
+	uint16_t i;
 	
-	//Initializing arrays
-	memset (&aes_struct, 0, sizeof(aes_struct));
-	memset (aes_data, 0, sizeof(aes_data));
-
-	//Initializing key
-	for (int i = 0; i < APP_AES_LENGTH; i++)
+	// Add counter
+	counter += m_counter;
+	if (p_ctx->ks_counter != counter)
 	{
-		aes_struct.key[i] = p_key[i];
+		p_ctx->ks_counter = counter;
+		p_ctx->ks_blocks = 0;
+		memcpy(&p_ctx->ecb.cleartext[0], &counter, sizeof(counter));
 	}
+	
+	for (i = 0; i < len; i++)
+	{
+		pos = (uint32_t)offset + i;
+		block = pos / APP_AES_LENGTH;
+		if (p_ks == NULL || !(pos % APP_AES_LENGTH))
+		{
+			if (block >= SSCAN_CTR_MAX_BLOCKS)
+			{
+				ctr_block_encrypt(p_ctx, block);
+				p_ks = p_ctx->ecb.ciphertext;
+			}
+			else
+			{
+				//Creating chipertext up to this block
+				while (p_ctx->ks_blocks <= block)
+				{
+					ctr_block_encrypt(p_ctx, p_ctx->ks_blocks);
+					memcpy(p_ctx->keystream[p_ctx->ks_blocks], p_ctx->ecb.ciphertext, APP_AES_LENGTH);
+					p_ctx->ks_blocks++;
+				}
+				p_ks = p_ctx->keystream[block];
+			}
+		}
+		
+		//XOR chipertext with p_in
+		p_out[i] = p_in[i] ^ p_ks[pos % APP_AES_LENGTH];
+	}
+}
 
-	//Initializing nouncence
-	memset (aes_struct.cleartext, 0xaa, sizeof(aes_struct.cleartext)); //todo: use more random data
+/**@brief Function for doubling a block in GF(2^128), as used for the CMAC subkeys.
+ */
+static void cmac_double(const uint8_t *p_in, uint8_t *p_out)
+{
+	uint8_t msb = p_in[0] & 0x80;
 	
-	// Add counter
-	counter += m_counter;
-	memcpy(&aes_struct.cleartext[0], &counter, sizeof(counter));
+	for (int i = 0; i < APP_AES_LENGTH - 1; i++)
+	{
+		p_out[i] = (p_in[i] << 1) | (p_in[i + 1] >> 7);
+	}
+	p_out[APP_AES_LENGTH - 1] = p_in[APP_AES_LENGTH - 1] << 1;
+	if (msb)
+		p_out[APP_AES_LENGTH - 1] ^= 0x87;
+}
+
+/**@brief Function for loading a key into a CMAC context.
+ * @details Use the built-in h/w encryption engine. The MAC key is AES(key, 0^128),
+ *          which no CTR nonce can produce since those carry 0xaa fill bytes. The
+ *          subkeys K1/K2 (RFC 4493) are cached so a tag costs one ECB per block.
+ * 
+ * @param[out] p_ctx  CMAC context to initialize
+ * @param[in] p_key   pointer to the 16-byte beacon key
+ */
+void sscan_cmac_init(sscan_cmac_ctx_t *p_ctx, const uint8_t *p_key)
+{
+	memcpy(p_ctx->ecb.key, p_key, APP_AES_LENGTH);
+	memset(p_ctx->ecb.cleartext, 0, APP_AES_LENGTH);
+	sd_ecb_block_encrypt(&p_ctx->ecb);
+	memcpy(p_ctx->ecb.key, p_ctx->ecb.ciphertext, APP_AES_LENGTH);
 	
-	//Creating chipertext
-	sd_ecb_block_encrypt(&aes_struct);  
+	// L = AES(K, 0^128), K1 = L.x, K2 = K1.x
+	sd_ecb_block_encrypt(&p_ctx->ecb);
+	cmac_double(p_ctx->ecb.ciphertext, p_ctx->k1);
+	cmac_double(p_ctx->k1, p_ctx->k2);
+}
 
-	//Decrypt -> XOR chipertext with p_data:
-	for (int i = 0; i < APP_AES_LENGTH; i++)
-	{  
-		aes_data[i] = p_data [i] ^ aes_struct.ciphertext[i];
+/**@brief Function for computing the truncated AES-CMAC tag of a message.
+ * 
+ * @param[in] p_ctx   CMAC context holding the subkeys
+ * @param[in] p_msg   pointer to the message
+ * @param[in] len     message length in bytes
+ * @param[out] p_mic  pointer to the SSCAN_MIC_LENGTH byte tag
+ */
+void sscan_cmac_tag(sscan_cmac_ctx_t *p_ctx, const uint8_t *p_msg, uint16_t len, uint8_t *p_mic)
+{
+	uint16_t blocks = (len + APP_AES_LENGTH - 1) / APP_AES_LENGTH;
+	uint16_t offset = 0;
+	uint8_t last[APP_AES_LENGTH];
+	
+	if (!blocks)
+		blocks = 1;
+	
+	// Last block is either complete and masked with K1, or padded with 10..0 and masked with K2.
+	memset(last, 0, APP_AES_LENGTH);
+	memcpy(last, p_msg + (blocks - 1) * APP_AES_LENGTH, len - (blocks - 1) * APP_AES_LENGTH);
+	if (len && !(len % APP_AES_LENGTH))
+	{
+		for (int i = 0; i < APP_AES_LENGTH; i++)
+			last[i] ^= p_ctx->k1[i];
+	}
+	else
+	{
+		last[len % APP_AES_LENGTH] = 0x80;
+		for (int i = 0; i < APP_AES_LENGTH; i++)
+			last[i] ^= p_ctx->k2[i];
 	}
 	
-	memcpy (p_out, aes_data, APP_AES_LENGTH);
+	memset(p_ctx->ecb.ciphertext, 0, APP_AES_LENGTH);
+	for (uint16_t block = 0; block < blocks; block++)
+	{
+		const uint8_t *p_block = (block == blocks - 1) ? last : p_msg + offset;
+		
+		for (int i = 0; i < APP_AES_LENGTH; i++)
+			p_ctx->ecb.cleartext[i] = p_ctx->ecb.ciphertext[i] ^ p_block[i];
+		sd_ecb_block_encrypt(&p_ctx->ecb);
+		offset += APP_AES_LENGTH;
+	}
+	memcpy(p_mic, p_ctx->ecb.ciphertext, SSCAN_MIC_LENGTH);
 }
 
 void sscan_init(void)
@@ -72,6 +197,8 @@ void sscan_set_device_uuid(uint8_t device_idx, uint8_t *p_data)
 void sscan_set_encryption_key(uint8_t device_idx, uint8_t *p_data)
 {
 	memcpy(beacons[device_idx].aes128_key, p_data, APP_AES_LENGTH);
+	sscan_ctr_init(&beacons[device_idx].ctr, p_data);
+	sscan_cmac_init(&beacons[device_idx].cmac, p_data);
 }
 
 void sscan_set_timeout_window(uint8_t device_idx, uint32_t timeout)
@@ -110,6 +237,26 @@ uint8_t sscan_get_device_index(const uint8_t * p_data)
 	return (idx);
 }
 
+/**@brief Function for checking the MIC of an authenticated beacon frame.
+ *
+ * @details The frame is the encrypted UUID, the counter and the tag, as sent by
+ *          beacons with be08=1. Call this before any other per-beacon work so a
+ *          forged frame costs two ECB operations and nothing else.
+ *
+ * @param[in]   device_idx  beacon index.
+ * @param[in]   p_frame     pointer to the SSCAN_AUTH_FRAME_LENGTH byte frame.
+ */
+bool sscan_verify_mic(uint8_t device_idx, const uint8_t *p_frame)
+{
+	uint8_t mic[SSCAN_MIC_LENGTH];
+	uint8_t diff = 0;
+	
+	sscan_cmac_tag(&beacons[device_idx].cmac, p_frame, APP_AES_LENGTH + SSCAN_COUNTER_LENGTH, mic);
+	for (int i = 0; i < SSCAN_MIC_LENGTH; i++)
+		diff |= mic[i] ^ p_frame[APP_AES_LENGTH + SSCAN_COUNTER_LENGTH + i];
+	return (diff == 0);
+}
+
 /**@brief Function for handling BLE Stack events related to our service and characteristic.
  *
  * @details Handles all events from the BLE stack of interest to Our Service.
@@ -136,7 +283,7 @@ bool sscan_decrypt_match_uuid (uint8_t device_idx, uint8_t *p_data, uint32_t cou
 	//for (int i = 0; i < 31; i++)
     //    SEGGER_RTT_printf(0, "data[%d]: 0x%#02x\n", i, p_data[i]); // Print service UUID should match definition BLE_UUID_OUR_SERVICE
 	//SEGGER_RTT_printf(0, "counter_tick: 0x%#08x\n", counter_tick);
-	encrypt_128bit_uuid(p_data, beacons[device_idx].aes128_key, extracted_uuid, m_counter + counter_tick);
+	sscan_ctr_crypt(&beacons[device_idx].ctr, counter_tick, 0, p_data, extracted_uuid, APP_AES_LENGTH);
 	if (!memcmp(extracted_uuid, beacons[device_idx].beacon_uuid, APP_AES_LENGTH))
 	{
 		return true;
@@ -6,12 +6,39 @@
 #define APP_NO_ADV_GAP_TICKS    250000
 #define APP_MAX_BEACON    		4
 #define APP_DEVICE_ID_LENGTH    6
+#define SSCAN_CTR_MAX_BLOCKS    2      // keystream blocks cached per counter, covers a full adv payload
+#define SSCAN_NONCE_FILL        0xaa   // nonce bytes not used by the counter or block index
+#define SSCAN_MIC_LENGTH        4      // truncated CMAC tag
+#define SSCAN_COUNTER_LENGTH    4
+#define SSCAN_AUTH_FRAME_LENGTH (APP_AES_LENGTH + SSCAN_COUNTER_LENGTH + SSCAN_MIC_LENGTH)
+
+#define SSCAN_FRAME_PLAIN       0      // config be08: CTR encrypted UUID only
+#define SSCAN_FRAME_CMAC        1      // config be08: CTR + truncated CMAC
 
 #define RC_SSCAN_FIRST_CONNECT	  0
 #define RC_SSCAN_CONNECTED		  1
 #define RC_SSCAN_FIRST_DISCONNECT 2
 #define RC_SSCAN_DISCONNECTED	  3
 
+// AES-CTR context for one key. The ECB block holds the key and the nonce
+// template; only the counter and block index bytes change per block.
+typedef struct
+{
+	nrf_ecb_hal_data_t	ecb;
+	uint32_t			ks_counter;   /* counter the cached keystream belongs to */
+	uint8_t				ks_blocks;    /* number of valid cached keystream blocks */
+	uint8_t				keystream[SSCAN_CTR_MAX_BLOCKS][APP_AES_LENGTH];
+} sscan_ctr_ctx_t;
+
+// AES-CMAC context for one key. The MAC key is derived from the beacon key,
+// and the two CMAC subkeys are computed once when the key is loaded.
+typedef struct
+{
+	nrf_ecb_hal_data_t	ecb;
+	uint8_t				k1[APP_AES_LENGTH];
+	uint8_t				k2[APP_AES_LENGTH];
+} sscan_cmac_ctx_t;
+
 // This structure contains various status information for our service. 
 // The name is based on the naming convention used in Nordics SDKs. 
 // 'ble indicates that it is a Bluetooth Low Energy relevant structure and 
@@ -23,6 +50,8 @@ typedef struct
 	uint8_t      	prev_adv_msg[APP_AES_LENGTH];
 	uint8_t      	beacon_uuid[APP_AES_LENGTH];
 	uint8_t			aes128_key[APP_AES_LENGTH];
+	sscan_ctr_ctx_t	ctr;
+	sscan_cmac_ctx_t cmac;
 	uint32_t		last_adv_timeout;
 	uint8_t 	    beacon_addr[APP_DEVICE_ID_LENGTH];
 	uint8_t			decrypt_enabled;
@@ -80,6 +109,15 @@ uint8_t sscan_check_disconnected(void);
 
 uint8_t sscan_query_connected(void);
 
-void encrypt_128bit_uuid (uint8_t *p_data, uint8_t *p_key, uint8_t *p_out, uint32_t counter);
+void sscan_ctr_init(sscan_ctr_ctx_t *p_ctx, const uint8_t *p_key);
+
+void sscan_ctr_crypt(sscan_ctr_ctx_t *p_ctx, uint32_t counter, uint16_t offset,
+                     const uint8_t *p_in, uint8_t *p_out, uint16_t len);
+
+void sscan_cmac_init(sscan_cmac_ctx_t *p_ctx, const uint8_t *p_key);
+
+void sscan_cmac_tag(sscan_cmac_ctx_t *p_ctx, const uint8_t *p_msg, uint16_t len, uint8_t *p_mic);
+
+bool sscan_verify_mic(uint8_t device_idx, const uint8_t *p_frame);
 
 #endif  /* _ SECURE_SCAN_H__ */
@@ -1,24 +1,188 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include "nrf.h"
 #include "uart_reply.h"
-#include "app_uart.h"
+#include "nrf_drv_uart.h"
+#include "app_util_platform.h"
+#include "app_error.h"
 
+static uart_reply_config_t	m_config;
+static uint8_t				m_rx_byte;
+static uint8_t				m_tx_buf[2][UART_REPLY_TX_BUF_LEN];
+static volatile uint8_t		m_tx_len[2];    // bytes queued in each TX buffer
+static volatile uint8_t		m_tx_fill;      // TX buffer the next bytes go to
+static volatile bool		m_tx_busy;      // the other TX buffer is being sent
+
+/**@brief Function to send the filling TX buffer if the UART is free.
+ * @details Must be called with the UART interrupt masked or from the UART interrupt.
+ *          The buffers swap, new bytes go to the one that was sent last.
+ */
+static void uart_reply_tx_start(void)
+{
+	uint8_t buf = m_tx_fill;
+
+	if (m_tx_busy || m_tx_len[buf] == 0)
+		return;
+
+	if (nrf_drv_uart_tx(m_tx_buf[buf], m_tx_len[buf]) != NRF_SUCCESS)
+		return;
+
+	m_tx_busy = true;
+	m_tx_fill = buf ^ 1;
+	m_tx_len[m_tx_fill] = 0;
+}
+
+/**@brief Function for handling the UART driver events.
+ * @details The next received byte is requested before the current one is handed
+ *          over, so that the receiver is never left without a buffer. A framing,
+ *          parity or overrun error drops the byte and the receiver is armed again.
+ */
+static void uart_reply_event_handle(nrf_drv_uart_event_t *p_event, void *p_context)
+{
+	uint8_t data;
+
+	switch (p_event->type)
+	{
+		case NRF_DRV_UART_EVT_RX_DONE:
+			data = m_rx_byte;
+			(void)nrf_drv_uart_rx(&m_rx_byte, 1);
+			m_config.rx_handler(data);
+			break;
+
+		case NRF_DRV_UART_EVT_TX_DONE:
+			m_tx_busy = false;
+			uart_reply_tx_start();
+			if (!m_tx_busy && m_config.tx_done_handler != NULL)
+				m_config.tx_done_handler();
+			break;
+
+		case NRF_DRV_UART_EVT_ERROR:
+			(void)nrf_drv_uart_rx(&m_rx_byte, 1);
+			if (m_config.rx_error_handler != NULL)
+				m_config.rx_error_handler();
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**@brief Function to start the UART driver with the settings in m_config.
+ */
+static uint32_t uart_reply_start(void)
+{
+	nrf_drv_uart_config_t config = NRF_DRV_UART_DEFAULT_CONFIG;
+	uint32_t err_code;
+
+	m_tx_len[0] = 0;
+	m_tx_len[1] = 0;
+	m_tx_fill = 0;
+	m_tx_busy = false;
+
+	config.pselrxd = m_config.rx_pin_no;
+	config.pseltxd = m_config.tx_pin_no;
+	config.pselrts = m_config.rts_pin_no;
+	config.pselcts = m_config.cts_pin_no;
+	config.hwfc = (m_config.flow_control) ? NRF_UART_HWFC_ENABLED : NRF_UART_HWFC_DISABLED;
+	config.baudrate = (nrf_uart_baudrate_t)m_config.baud_rate;
+	config.interrupt_priority = APP_IRQ_PRIORITY_LOW;
+#ifdef NRF52
+	config.use_easy_dma = true;
+#endif
+
+	err_code = nrf_drv_uart_init(&config, uart_reply_event_handle);
+	if (err_code != NRF_SUCCESS)
+		return (err_code);
+
+	return (nrf_drv_uart_rx(&m_rx_byte, 1));
+}
+
+/**@brief Function to start the UART, receiving and sending through interrupts.
+ * @details On nRF52 the UARTE is used, each TX buffer goes out by EasyDMA with a
+ *          single interrupt at the end. On nRF51 the driver feeds the UART from
+ *          the buffer one byte per interrupt.
+ *
+ * @param[in] p_config  pins, rate and handlers, copied.
+ *
+ * @return NRF_SUCCESS or the error of the UART driver.
+ */
+uint32_t uart_reply_init(const uart_reply_config_t *p_config)
+{
+	m_config = *p_config;
+	return (uart_reply_start());
+}
+
+/**@brief Function to restart the UART with another rate and flow control.
+ * @details Bytes still queued for TX are dropped and a byte being received is lost,
+ *          call it once uart_reply_idle returns true.
+ *
+ * @param[in] baud_rate     NRF_UART_BAUDRATE_xxx.
+ * @param[in] flow_control  true to use the RTS/CTS pins.
+ *
+ * @return NRF_SUCCESS or the error of the UART driver.
+ */
+uint32_t uart_reply_baud_set(uint32_t baud_rate, bool flow_control)
+{
+	nrf_drv_uart_uninit();
+	m_config.baud_rate = baud_rate;
+	m_config.flow_control = flow_control;
+	return (uart_reply_start());
+}
 
 void uart_reply_byte(uint8_t data)
 {
-	while(app_uart_put(data) != NRF_SUCCESS);
+	uart_reply_data(&data, 1);
 }
 
-/**@brief Function to store the current at command in the at command table.
- * @details Use the built-in h/w encryption engine.
- * 
- * @param[in] p_data  pointer to the at command in the raw data buffer.
- * @param[in] cmd_len  size, in bytes, of the current at command.
+/**@brief Function to queue bytes for the UART.
+ * @details The bytes are copied into the filling TX buffer, which is sent as soon as
+ *          the UART is free. The call only waits when both buffers are full, use
+ *          uart_reply_space to avoid it.
+ *
+ * @param[in] p_data  bytes to send.
+ * @param[in] len     size, in bytes, of the data.
  */
-void uart_reply_string(char *p_str)
+void uart_reply_data(const uint8_t *p_data, uint16_t len)
 {
-	for (uint16_t i = 0; i < strlen(p_str); i++)
+	uint16_t n;
+	uint8_t buf;
+
+	while (len)
 	{
-		while(app_uart_put(p_str[i]) != NRF_SUCCESS);
+		CRITICAL_REGION_ENTER();
+		buf = m_tx_fill;
+		n = UART_REPLY_TX_BUF_LEN - m_tx_len[buf];
+		if (n > len)
+			n = len;
+		memcpy(&m_tx_buf[buf][m_tx_len[buf]], p_data, n);
+		m_tx_len[buf] += n;
+		uart_reply_tx_start();
+		CRITICAL_REGION_EXIT();
+
+		p_data += n;
+		len -= n;
+		// Both buffers are full, wait for the one being sent.
+		while (len && m_tx_len[m_tx_fill] == UART_REPLY_TX_BUF_LEN)
+			__WFE();
 	}
-}
\ No newline at end of file
+}
+
+void uart_reply_string(char *p_str)
+{
+	uart_reply_data((const uint8_t *)p_str, strlen(p_str));
+}
+
+/**@brief Function to get how many bytes uart_reply_data takes without waiting.
+ */
+uint16_t uart_reply_space(void)
+{
+	return (UART_REPLY_TX_BUF_LEN - m_tx_len[m_tx_fill]);
+}
+
+/**@brief Function to check that every queued byte has been sent.
+ */
+bool uart_reply_idle(void)
+{
+	return (!m_tx_busy && m_tx_len[m_tx_fill] == 0);
+}
@@ -1,8 +1,31 @@
-
 #ifndef UART_REPLY_H__
 #define UART_REPLY_H__
 
+#define UART_REPLY_TX_BUF_LEN   128    // bytes per TX buffer, at most 255 for one nrf_drv_uart transfer
+
+typedef void (*uart_reply_rx_handler_t)(uint8_t data);
+typedef void (*uart_reply_tx_done_handler_t)(void);
+typedef void (*uart_reply_rx_error_handler_t)(void);
+
+typedef struct
+{
+	uint8_t							rx_pin_no;
+	uint8_t							tx_pin_no;
+	uint8_t							rts_pin_no;
+	uint8_t							cts_pin_no;
+	bool							flow_control;
+	uint32_t						baud_rate;        // NRF_UART_BAUDRATE_xxx
+	uart_reply_rx_handler_t			rx_handler;       // called from the UART IRQ for each byte received
+	uart_reply_tx_done_handler_t	tx_done_handler;  // optional, called from the UART IRQ once all bytes are sent
+	uart_reply_rx_error_handler_t	rx_error_handler; // optional, called from the UART IRQ when a byte was lost
+} uart_reply_config_t;
+
+uint32_t uart_reply_init(const uart_reply_config_t *p_config);
+uint32_t uart_reply_baud_set(uint32_t baud_rate, bool flow_control);
 void uart_reply_byte(uint8_t data);
 void uart_reply_string(char *p_str);
+void uart_reply_data(const uint8_t *p_data, uint16_t len);
+uint16_t uart_reply_space(void);
+bool uart_reply_idle(void);
 
 #endif  /* _ UART_REPLY_H__ */
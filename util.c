@@ -215,3 +215,54 @@ void big_to_small_endian(uint8_t *p_data, uint8_t len)
 		*(p_data + len - i - 1) = val;
 	}
 }
+
+/**@brief Function for computing a CRC-16/CCITT, MSB first.
+ *
+ * @param[in] p_data  data to run the CRC over.
+ * @param[in] len     size, in bytes, of the data.
+ * @param[in] crc     CRC16_CCITT_INIT, or the CRC of the preceding data.
+ */
+uint16_t crc16_ccitt(const uint8_t *p_data, uint16_t len, uint16_t crc)
+{
+	uint16_t i;
+	uint8_t j;
+	
+	for (i = 0; i < len; i++)
+	{
+		crc ^= (uint16_t)*(p_data + i) << 8;
+		for (j = 0; j < 8; j++)
+		{
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ CRC16_CCITT_POLY;
+			else
+				crc <<= 1;
+		}
+	}
+	return (crc);
+}
+
+/**@brief Function for computing a CRC-32 (IEEE 802.3), LSB first.
+ *
+ * @param[in] p_data  data to run the CRC over.
+ * @param[in] len     size, in bytes, of the data.
+ * @param[in] crc     CRC32_INIT, or the CRC of the preceding data.
+ */
+uint32_t crc32_ieee(const uint8_t *p_data, uint16_t len, uint32_t crc)
+{
+	uint16_t i;
+	uint8_t j;
+	
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+	{
+		crc ^= *(p_data + i);
+		for (j = 0; j < 8; j++)
+		{
+			if (crc & 1)
+				crc = (crc >> 1) ^ CRC32_POLY;
+			else
+				crc >>= 1;
+		}
+	}
+	return (~crc);
+}
@@ -11,6 +11,10 @@
 #define ZERO						'0'
 #define DIVISOR						10
 #define SCALER						10
+#define CRC16_CCITT_INIT			0xFFFF
+#define CRC16_CCITT_POLY			0x1021
+#define CRC32_INIT					0x00000000
+#define CRC32_POLY					0xEDB88320	// IEEE 802.3, reflected
 									
 uint8_t byte_to_ascii (uint8_t *p_dest, uint8_t value);
 uint8_t word_to_ascii (uint8_t *p_dest, uint16_t value);
@@ -20,5 +24,7 @@ uint16_t ascii_to_word (uint8_t *p_data, uint8_t len);
 uint32_t ascii_to_longword (uint8_t *p_data, uint8_t len);
 uint8_t ascii_to_bcd (char msn, char lsn);
 void big_to_small_endian(uint8_t *p_data, uint8_t len);
+uint16_t crc16_ccitt(const uint8_t *p_data, uint16_t len, uint16_t crc);
+uint32_t crc32_ieee(const uint8_t *p_data, uint16_t len, uint32_t crc);
 
 #endif  /* _ UTIL_H__ */